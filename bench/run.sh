@@ -0,0 +1,303 @@
+#!/bin/sh
+#-------------------------------------------------------------------------
+#
+# run.sh
+#
+#    pgbench suite of the extension, run by make bench.
+#
+#    Each workload of WORKLOADS is run with pgbench for each mode of
+#    MODES, after a baseline run without the extension:
+#
+#      oltp        short transaction, one UPDATE, one SELECT, one INSERT
+#      read_heavy  ten SELECTs for one UPDATE
+#      function    writes nested in a PL/pgSQL function
+#      cursor      FETCHes from a cursor around an UPDATE
+#      do_block    writes in a DO block
+#      long_N      transaction of N INSERTs
+#      depth_N     transaction of NSTMT INSERTs behind N client savepoints,
+#                  rolled back
+#      mixed_P     transaction of NWRITE INSERTs, each followed by a SELECT,
+#                  and NREAD other SELECTs, rolled back, run with the
+#                  pgbench protocol P: simple, extended or prepared
+#      partitions  transaction of NSTMT single row UPDATEs on a hash
+#                  partitioned table of NPART partitions, rolled back, each
+#                  UPDATE locks all the partitions (PostgreSQL 11 or later,
+#                  max_locks_per_transaction must allow NPART locks)
+#
+#    and the modes are:
+#
+#      off         extension loaded but disabled
+#      all         automatic savepoint after each statement
+#      writeonly   automatic savepoint after write statements only
+#      hoist       like all, with hoist_planner_locks
+#
+#    The tps, the 50th, 95th and 99th percentiles of the transaction
+#    latency and the number of subtransaction xids assigned per
+#    transaction are reported.  Subtransaction xids are those consumed
+#    above the baseline, the server must not run other write transactions
+#    during the benchmark.  Requires pgbench 10 or later, the extension
+#    must not be in shared_preload_libraries.
+#
+#    Before each run of the mixed_P workloads, the number of rollovers of
+#    one transaction is checked with pg_statement_rollback_latency(): in
+#    writeonly mode only the INSERTs are followed by a rollover, including
+#    when the statements run from cached plans.  The check requires pgbench
+#    12 or later, the extension is created in the database.
+#
+#    Connection parameters are taken from the usual PG* environment
+#    variables, the user must be allowed to set session_preload_libraries.
+#
+# Licence: PostgreSQL
+# Copyright (c) 2020-2023 LzLabs, GmbH
+#
+#-------------------------------------------------------------------------
+
+WORKLOADS=${WORKLOADS:-"oltp read_heavy function cursor do_block long_50 long_100 long_500 long_5000 depth_1 depth_8 depth_32 depth_64 mixed_simple mixed_extended mixed_prepared partitions"}
+MODES=${MODES:-"off all writeonly hoist"}
+ROWS=${ROWS:-100000}
+NSTMT=${NSTMT:-100}
+NPART=${NPART:-1000}
+NWRITE=${NWRITE:-10}
+NREAD=${NREAD:-10}
+CLIENTS=${CLIENTS:-4}
+JOBS=${JOBS:-$CLIENTS}
+DURATION=${DURATION:-10}
+PGBENCH=${PGBENCH:-pgbench}
+PSQL=${PSQL:-psql}
+
+SCRIPTS=`dirname $0`/scripts
+WORKDIR=`mktemp -d /tmp/slr_bench.XXXXXX`
+trap 'rm -rf $WORKDIR' EXIT
+
+$PSQL -q -X -v rows=$ROWS -f $SCRIPTS/setup.sql || exit 1
+
+# Options of the session for the mode $1
+mode_options()
+{
+	case $1 in
+		baseline)
+			echo ""
+			;;
+		off)
+			echo "-c session_preload_libraries=pg_statement_rollback -c pg_statement_rollback.enabled=off"
+			;;
+		all)
+			echo "-c session_preload_libraries=pg_statement_rollback -c pg_statement_rollback.enabled=on -c pg_statement_rollback.enable_writeonly=off"
+			;;
+		writeonly)
+			echo "-c session_preload_libraries=pg_statement_rollback -c pg_statement_rollback.enabled=on -c pg_statement_rollback.enable_writeonly=on"
+			;;
+		hoist)
+			echo "-c session_preload_libraries=pg_statement_rollback -c pg_statement_rollback.enabled=on -c pg_statement_rollback.enable_writeonly=off -c pg_statement_rollback.hoist_planner_locks=on"
+			;;
+		*)
+			echo "unknown mode $1" >&2
+			exit 1
+			;;
+	esac
+}
+
+# pgbench script of the workload $1
+workload_script()
+{
+	case $1 in
+		long_*)
+			nstmt=`echo $1 | sed 's/^long_//'`
+			script=$WORKDIR/$1.sql
+			if [ ! -f $script ]
+			then
+				echo "BEGIN;" > $script
+				i=0
+				while [ $i -lt $nstmt ]
+				do
+					i=`expr $i + 1`
+					echo "INSERT INTO slr_bench_history(aid, delta) VALUES ($i, 1);" >> $script
+				done
+				echo "END;" >> $script
+			fi
+			echo $script
+			;;
+		depth_*)
+			depth=`echo $1 | sed 's/^depth_//'`
+			script=$WORKDIR/$1.sql
+			if [ ! -f $script ]
+			then
+				echo "BEGIN;" > $script
+				i=0
+				while [ $i -lt $depth ]
+				do
+					i=`expr $i + 1`
+					echo "SAVEPOINT s$i;" >> $script
+				done
+				i=0
+				while [ $i -lt $NSTMT ]
+				do
+					i=`expr $i + 1`
+					echo "INSERT INTO slr_bench_history(aid, delta) VALUES ($i, 1);" >> $script
+				done
+				echo "ROLLBACK;" >> $script
+			fi
+			echo $script
+			;;
+		mixed_*)
+			script=$WORKDIR/mixed.sql
+			if [ ! -f $script ]
+			then
+				echo "BEGIN;" > $script
+				i=0
+				while [ $i -lt $NWRITE ]
+				do
+					i=`expr $i + 1`
+					echo "INSERT INTO slr_bench_history(aid, delta) VALUES ($i, 1);" >> $script
+					echo "SELECT abalance FROM slr_bench_accounts WHERE aid = $i;" >> $script
+				done
+				i=0
+				while [ $i -lt $NREAD ]
+				do
+					i=`expr $i + 1`
+					echo "SELECT $i;" >> $script
+				done
+				echo "ROLLBACK;" >> $script
+			fi
+			echo $script
+			;;
+		partitions)
+			script=$WORKDIR/$1.sql
+			if [ ! -f $script ]
+			then
+				# One row per partition, the qual on v prevents pruning
+				setup=$WORKDIR/partitions_setup.sql
+				echo "DROP TABLE IF EXISTS slr_bench_part;" > $setup
+				echo "CREATE TABLE slr_bench_part(id integer, v integer, n integer DEFAULT 0) PARTITION BY HASH (id);" >> $setup
+				i=0
+				while [ $i -lt $NPART ]
+				do
+					echo "CREATE TABLE slr_bench_part_$i PARTITION OF slr_bench_part FOR VALUES WITH (MODULUS $NPART, REMAINDER $i);" >> $setup
+					i=`expr $i + 1`
+				done
+				echo "INSERT INTO slr_bench_part(id, v) SELECT i, i FROM generate_series(1, $NPART) i;" >> $setup
+				echo "VACUUM ANALYZE slr_bench_part;" >> $setup
+				$PSQL -q -X -f $setup >&2 || exit 1
+
+				echo "BEGIN;" > $script
+				i=0
+				while [ $i -lt $NSTMT ]
+				do
+					i=`expr $i + 1`
+					echo "UPDATE slr_bench_part SET n = n + 1 WHERE v = $i;" >> $script
+				done
+				echo "ROLLBACK;" >> $script
+			fi
+			echo $script
+			;;
+		*)
+			echo $SCRIPTS/$1.sql
+			;;
+	esac
+}
+
+# pgbench protocol of the workload $1
+workload_protocol()
+{
+	case $1 in
+		mixed_*)
+			echo $1 | sed 's/^mixed_//'
+			;;
+		*)
+			echo simple
+			;;
+	esac
+}
+
+# Run one transaction of the mixed_P workload $1 in the mode $2 and check
+# the number of rollovers done in the session: one after each statement in
+# all and hoist modes, one after each INSERT only in writeonly mode.  The division by
+# zero aborts the client when the count is wrong.
+check_rollovers()
+{
+	case $2 in
+		off)
+			expected=0
+			;;
+		all|hoist)
+			expected=`expr 2 \* $NWRITE + $NREAD`
+			;;
+		*)
+			expected=$NWRITE
+			;;
+	esac
+
+	check=$WORKDIR/check.sql
+	printf '%s\n' 'SELECT coalesce(sum(count), 0) AS before FROM pg_statement_rollback_latency() \gset' > $check
+	cat `workload_script $1` >> $check
+	echo "SELECT 1 / (coalesce(sum(count), 0) - :before = $expected)::integer FROM pg_statement_rollback_latency();" >> $check
+
+	PGOPTIONS="`mode_options $2`" \
+		$PGBENCH -n -M `workload_protocol $1` -f $check -t 1 -c 1 > $WORKDIR/check.out 2>&1
+	if ! grep -q '^number of transactions actually processed: 1/1' $WORKDIR/check.out
+	then
+		echo "$1 $2: expected $expected rollovers per transaction" >&2
+		cat $WORKDIR/check.out >&2
+		exit 1
+	fi
+}
+
+# Run the workload $1 in the mode $2, prints the tps, the latency
+# percentiles in ms and the xids consumed per transaction
+run_bench()
+{
+	script=`workload_script $1`
+	rm -f $WORKDIR/log.*
+	$PSQL -q -X -c "TRUNCATE slr_bench_history;" || exit 1
+	xid_start=`$PSQL -A -t -X -c "SELECT txid_current();"`
+
+	case $1 in
+		mixed_*)
+			[ $2 = baseline ] || check_rollovers $1 $2
+			;;
+	esac
+
+	PGOPTIONS="`mode_options $2`" \
+		$PGBENCH -n -M `workload_protocol $1` -f $script -D rows=$ROWS -T $DURATION -c $CLIENTS -j $JOBS \
+			-l --log-prefix=$WORKDIR/log > $WORKDIR/out 2>/dev/null
+
+	xid_end=`$PSQL -A -t -X -c "SELECT txid_current();"`
+	tps=`sed -n 's/^tps = \([0-9.]*\) .*$/\1/p' $WORKDIR/out | head -1`
+	xacts=`sed -n 's/^number of transactions actually processed: \([0-9]*\).*$/\1/p' $WORKDIR/out`
+	if [ -z "$xacts" ] || [ "$xacts" -eq 0 ]
+	then
+		echo "$1 $2: pgbench failed" >&2
+		cat $WORKDIR/out >&2
+		exit 1
+	fi
+
+	# The third column of the transaction log is the latency in us
+	cat $WORKDIR/log.* | awk '{ print $3 }' | sort -n > $WORKDIR/latencies
+	percentiles=`awk 'function pct(p) { i = int(NR * p); if (i < 1) i = 1; return l[i] / 1000 }
+		{ l[NR] = $1 }
+		END { printf "%.3f %.3f %.3f", pct(0.50), pct(0.95), pct(0.99) }' $WORKDIR/latencies`
+
+	# The first call to txid_current() consumed a xid
+	xids=`echo "($xid_end - $xid_start - 1) / $xacts" | bc -l`
+
+	echo "$tps $percentiles $xids"
+}
+
+printf "%-14s %-10s %10s %10s %10s %10s %14s\n" "workload" "mode" "tps" "p50 (ms)" "p95 (ms)" "p99 (ms)" "subxids/xact"
+for workload in $WORKLOADS
+do
+	base_xids=
+	for mode in baseline $MODES
+	do
+		set -- `run_bench $workload $mode`
+		[ $# -eq 5 ] || exit 1
+		if [ -z "$base_xids" ]
+		then
+			base_xids=$5
+		fi
+		subxids=`echo "$5 - $base_xids" | bc -l`
+		printf "%-14s %-10s %10.1f %10.3f %10.3f %10.3f %14.2f\n" $workload $mode $1 $2 $3 $4 $subxids
+	done
+done
+
+$PSQL -q -X -c "DROP FUNCTION slr_bench_insert(integer); DROP TABLE slr_bench_accounts, slr_bench_history; DROP TABLE IF EXISTS slr_bench_part;"
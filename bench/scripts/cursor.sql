@@ -0,0 +1,10 @@
+-- Cursor fetched around a write statement
+\set aid random(1, :rows - 30)
+BEGIN;
+DECLARE slr_cur CURSOR FOR SELECT aid, abalance FROM slr_bench_accounts WHERE aid >= :aid ORDER BY aid;
+FETCH 10 FROM slr_cur;
+UPDATE slr_bench_accounts SET abalance = abalance + 1 WHERE aid = :aid;
+FETCH 10 FROM slr_cur;
+FETCH 10 FROM slr_cur;
+CLOSE slr_cur;
+END;
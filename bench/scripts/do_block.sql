@@ -0,0 +1,13 @@
+-- Writes in an anonymous code block, on the first 1000 accounts as the
+-- variables of pgbench can not be used in the block
+BEGIN;
+DO $$
+DECLARE
+    v_aid integer := 1 + floor(random() * 1000);
+BEGIN
+    INSERT INTO slr_bench_history(aid, delta) VALUES (v_aid, 1);
+    UPDATE slr_bench_accounts SET abalance = abalance + 1 WHERE aid = v_aid;
+END
+$$;
+SELECT count(*) FROM slr_bench_history WHERE aid = 1;
+END;
@@ -0,0 +1,7 @@
+-- Writes nested in a PL/pgSQL function called from a SELECT
+\set aid random(1, :rows)
+BEGIN;
+SELECT slr_bench_insert(:aid);
+SELECT abalance FROM slr_bench_accounts WHERE aid = :aid;
+SELECT slr_bench_insert(:aid);
+END;
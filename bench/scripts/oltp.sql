@@ -0,0 +1,8 @@
+-- Short OLTP transaction: one write, one read, one insert
+\set aid random(1, :rows)
+\set delta random(-5000, 5000)
+BEGIN;
+UPDATE slr_bench_accounts SET abalance = abalance + :delta WHERE aid = :aid;
+SELECT abalance FROM slr_bench_accounts WHERE aid = :aid;
+INSERT INTO slr_bench_history(aid, delta) VALUES (:aid, :delta);
+END;
@@ -0,0 +1,15 @@
+-- Read heavy transaction: ten reads for one write
+\set aid random(1, :rows)
+BEGIN;
+SELECT abalance FROM slr_bench_accounts WHERE aid = :aid;
+SELECT abalance FROM slr_bench_accounts WHERE aid = :aid;
+SELECT abalance FROM slr_bench_accounts WHERE aid = :aid;
+SELECT abalance FROM slr_bench_accounts WHERE aid = :aid;
+SELECT abalance FROM slr_bench_accounts WHERE aid = :aid;
+SELECT abalance FROM slr_bench_accounts WHERE aid = :aid;
+SELECT abalance FROM slr_bench_accounts WHERE aid = :aid;
+SELECT abalance FROM slr_bench_accounts WHERE aid = :aid;
+SELECT abalance FROM slr_bench_accounts WHERE aid = :aid;
+SELECT abalance FROM slr_bench_accounts WHERE aid = :aid;
+UPDATE slr_bench_accounts SET abalance = abalance + 1 WHERE aid = :aid;
+END;
@@ -0,0 +1,19 @@
+-- Tables and function used by the pgbench scripts of bench/run.sh, the
+-- number of accounts is given by the psql variable rows
+CREATE EXTENSION IF NOT EXISTS pg_statement_rollback;
+DROP TABLE IF EXISTS slr_bench_accounts, slr_bench_history CASCADE;
+CREATE TABLE slr_bench_accounts(aid integer PRIMARY KEY, abalance integer NOT NULL DEFAULT 0, filler char(84));
+INSERT INTO slr_bench_accounts(aid) SELECT generate_series(1, :rows);
+CREATE TABLE slr_bench_history(aid integer, delta integer, mtime timestamp DEFAULT now());
+
+-- Write statements nested in a function, like test_insert() of the
+-- regression tests
+CREATE OR REPLACE FUNCTION slr_bench_insert(p_aid integer) RETURNS integer AS $$
+BEGIN
+    INSERT INTO slr_bench_history(aid, delta) VALUES (p_aid, 1);
+    UPDATE slr_bench_accounts SET abalance = abalance + 1 WHERE aid = p_aid;
+    RETURN 1;
+END
+$$ LANGUAGE plpgsql;
+
+VACUUM ANALYZE slr_bench_accounts;
@@ -0,0 +1,499 @@
+/*-------------------------------------------------------------------------
+ *
+ * slr_loadgen.c
+ *
+ *    Load generator comparing the automatic savepoint of the server to the
+ *    savepoints of the client, through the libpq pipeline mode and the
+ *    extended protocol.
+ *
+ *    Each transaction runs a number of INSERTs of a prepared statement,
+ *    sent in batches followed by a sync point, like the batched drivers do.
+ *    Some statements fail on purpose, at the given rate, by violating a
+ *    check constraint.  The rest of the batch is then aborted by the
+ *    server, the client recovers with a ROLLBACK TO the savepoint and sends
+ *    the aborted statements again, the failed statement is skipped.  In
+ *    client mode the savepoint is then released, the RELEASE sent after
+ *    the failed statement has been aborted with the rest of the batch.
+ *
+ *    In server mode the savepoint is the automatic savepoint of the
+ *    extension.  In client mode, the baseline, each statement is wrapped
+ *    in a SAVEPOINT and a RELEASE like with psql ON_ERROR_ROLLBACK or the
+ *    JDBC autosave option, and the extension is not loaded.
+ *
+ *    The throughput and the recovery latency, from the error to the end of
+ *    the ROLLBACK TO and of the RELEASE in client mode, are reported.  Requires libpq 14 or later.
+ *
+ * Licence: PostgreSQL
+ * Copyright (c) 2020-2023 LzLabs, GmbH
+ *
+ *-------------------------------------------------------------------------
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libpq-fe.h"
+
+#define CLIENT_SAVEPOINT	"slr_loadgen"
+
+typedef enum
+{
+	ITEM_BEGIN,
+	ITEM_INSERT,
+	ITEM_COMMIT
+} ItemKind;
+
+typedef struct
+{
+	ItemKind	kind;
+	int			fail;			/* statement violating the constraint */
+} Item;
+
+static PGconn *conn = NULL;
+static int	client_mode = 0;
+static char *savepoint_name = NULL;
+static char *rollback_command = NULL;
+static uint64_t rng_state = 0;
+static int64_t next_id = 0;
+
+/* Recovery latencies in ms */
+static double *recoveries = NULL;
+static int	nrecoveries = 0;
+static int	maxrecoveries = 0;
+
+static void
+usage(const char *progname)
+{
+	printf("Usage: %s [OPTION]... [CONNINFO]\n\n"
+		   "Options:\n"
+		   "  -m MODE    server (automatic savepoint) or client (baseline), default server\n"
+		   "  -t NUM     number of transactions, default 1000\n"
+		   "  -s NUM     statements per transaction, default 100\n"
+		   "  -b NUM     statements per pipeline sync, default 10\n"
+		   "  -e RATE    fraction of statements failing, default 0.01\n"
+		   "  -S SEED    seed of the error injection, default 1\n",
+		   progname);
+}
+
+static void
+die(const char *msg)
+{
+	fprintf(stderr, "slr_loadgen: %s", msg);
+	if (conn != NULL)
+		fprintf(stderr, ": %s", PQerrorMessage(conn));
+	fprintf(stderr, "\n");
+	if (conn != NULL)
+		PQfinish(conn);
+	exit(1);
+}
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* splitmix64, spreads the bits of the seed over the xorshift64* state */
+static void
+rng_seed(uint64_t seed)
+{
+	uint64_t	z = seed + 0x9E3779B97F4A7C15ULL;
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	rng_state = z ^ (z >> 31);
+
+	/* The state of xorshift64* must not be zero */
+	if (rng_state == 0)
+		rng_state = 0x2545F4914F6CDD1DULL;
+}
+
+/* xorshift64*, uniform in [0, 1) */
+static double
+rng_double(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (double) ((rng_state * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+/* Run a command outside of the pipeline, returns its first value if any */
+static char *
+exec_simple(const char *sql)
+{
+	PGresult   *res = PQexec(conn, sql);
+	char	   *value = NULL;
+
+	if (PQresultStatus(res) != PGRES_COMMAND_OK &&
+		PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		fprintf(stderr, "slr_loadgen: %s failed: %s", sql, PQerrorMessage(conn));
+		PQclear(res);
+		PQfinish(conn);
+		exit(1);
+	}
+	if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) > 0)
+		value = strdup(PQgetvalue(res, 0, 0));
+	PQclear(res);
+
+	return value;
+}
+
+static void
+send_command(const char *sql)
+{
+	if (!PQsendQueryParams(conn, sql, 0, NULL, NULL, NULL, NULL, 0))
+		die("could not send command");
+}
+
+static void
+send_insert(int fail)
+{
+	char		id[32];
+	char		v[16];
+	const char *values[2];
+
+	snprintf(id, sizeof(id), "%lld", (long long) next_id++);
+	snprintf(v, sizeof(v), "%d", fail ? -1 : 1);
+	values[0] = id;
+	values[1] = v;
+
+	if (!PQsendQueryPrepared(conn, "slr_loadgen_insert", 2, values,
+							 NULL, NULL, 0))
+		die("could not send statement");
+}
+
+/*
+ * Read the results of the commands sent up to the sync point.  Returns the
+ * number of commands read before the first error, or -1 when all commands
+ * succeeded.  *error_time is set to the time the error was received.
+ */
+static int
+read_results(double *error_time)
+{
+	int			ncommands = 0;
+	int			failed = -1;
+
+	for (;;)
+	{
+		PGresult   *res = PQgetResult(conn);
+
+		if (res == NULL)
+		{
+			/* End of the results of a command */
+			ncommands++;
+			continue;
+		}
+
+		switch (PQresultStatus(res))
+		{
+			case PGRES_PIPELINE_SYNC:
+				PQclear(res);
+				return failed;
+			case PGRES_COMMAND_OK:
+			case PGRES_TUPLES_OK:
+			case PGRES_PIPELINE_ABORTED:
+				break;
+			case PGRES_FATAL_ERROR:
+				if (failed < 0)
+				{
+					failed = ncommands;
+					*error_time = now_ms();
+				}
+				break;
+			default:
+				PQclear(res);
+				die("unexpected result in pipeline");
+		}
+		PQclear(res);
+	}
+}
+
+/*
+ * Roll back to the savepoint and, in client mode, release it like psql
+ * ON_ERROR_ROLLBACK and the JDBC autosave option do, in a single sync point
+ */
+static void
+recover(void)
+{
+	double		unused;
+
+	send_command(rollback_command);
+	if (client_mode)
+		send_command("RELEASE SAVEPOINT " CLIENT_SAVEPOINT);
+	if (!PQpipelineSync(conn))
+		die("could not send sync point");
+	if (read_results(&unused) >= 0)
+		die("could not recover from the error");
+}
+
+static void
+add_recovery(double msec)
+{
+	if (nrecoveries == maxrecoveries)
+	{
+		maxrecoveries = maxrecoveries > 0 ? maxrecoveries * 2 : 1024;
+		recoveries = realloc(recoveries, maxrecoveries * sizeof(double));
+		if (recoveries == NULL)
+			die("out of memory");
+	}
+	recoveries[nrecoveries++] = msec;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double		x = *(const double *) a;
+	double		y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+percentile(double p)
+{
+	int			i = (int) (nrecoveries * p);
+
+	if (i >= nrecoveries)
+		i = nrecoveries - 1;
+	return recoveries[i];
+}
+
+/*
+ * Run one transaction of nitems items, in batches of batch items each
+ * followed by a sync point.  Returns the number of injected errors.
+ */
+static int
+run_transaction(Item *items, int nitems, int batch)
+{
+	int			next = 0;
+	int			nerrors = 0;
+
+	while (next < nitems)
+	{
+		int			last = next + batch < nitems ? next + batch : nitems;
+		int			failed;
+		int			ncommands = 0;
+		int			i;
+		double		error_time = 0;
+
+		/*
+		 * The number of commands sent before a sync point is bounded by
+		 * the batch size, the pipeline can not fill the socket buffers.
+		 */
+		for (i = next; i < last; i++)
+		{
+			switch (items[i].kind)
+			{
+				case ITEM_BEGIN:
+					send_command("BEGIN");
+					break;
+				case ITEM_COMMIT:
+					send_command("COMMIT");
+					break;
+				case ITEM_INSERT:
+					if (client_mode)
+						send_command("SAVEPOINT " CLIENT_SAVEPOINT);
+					send_insert(items[i].fail);
+					if (client_mode)
+						send_command("RELEASE SAVEPOINT " CLIENT_SAVEPOINT);
+					break;
+			}
+		}
+		if (!PQpipelineSync(conn))
+			die("could not send sync point");
+
+		failed = read_results(&error_time);
+		if (failed < 0)
+		{
+			next = last;
+			continue;
+		}
+
+		/* Find the item of the failed command */
+		for (i = next; i < last; i++)
+		{
+			int			n = (items[i].kind == ITEM_INSERT && client_mode) ? 3 : 1;
+
+			if (failed < ncommands + n)
+				break;
+			ncommands += n;
+		}
+		if (i == last || items[i].kind != ITEM_INSERT || !items[i].fail)
+			die("unexpected error");
+		nerrors++;
+
+		/* Recover and skip the failed statement */
+		recover();
+		add_recovery(now_ms() - error_time);
+
+		next = i + 1;
+	}
+
+	return nerrors;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *keywords[3];
+	const char *values[3];
+	const char *mode = "server";
+	const char *name;
+	PGresult   *res;
+	int			ntransactions = 1000;
+	int			nstatements = 100;
+	int			batch = 10;
+	double		error_rate = 0.01;
+	uint64_t	seed = 1;
+	Item	   *items;
+	int			nitems;
+	int			nerrors = 0;
+	int			c;
+	int			i;
+	int			t;
+	double		start;
+	double		elapsed;
+	double		total = 0;
+
+	while ((c = getopt(argc, argv, "m:t:s:b:e:S:h")) != -1)
+	{
+		switch (c)
+		{
+			case 'm':
+				mode = optarg;
+				break;
+			case 't':
+				ntransactions = atoi(optarg);
+				break;
+			case 's':
+				nstatements = atoi(optarg);
+				break;
+			case 'b':
+				batch = atoi(optarg);
+				break;
+			case 'e':
+				error_rate = atof(optarg);
+				break;
+			case 'S':
+				seed = (uint64_t) strtoull(optarg, NULL, 10);
+				break;
+			case 'h':
+				usage(argv[0]);
+				exit(0);
+			default:
+				usage(argv[0]);
+				exit(1);
+		}
+	}
+
+	rng_seed(seed);
+
+	if (strcmp(mode, "client") == 0)
+		client_mode = 1;
+	else if (strcmp(mode, "server") != 0)
+	{
+		fprintf(stderr, "slr_loadgen: unknown mode \"%s\"\n", mode);
+		exit(1);
+	}
+	if (ntransactions <= 0 || nstatements <= 0 || batch <= 0 ||
+		error_rate < 0 || error_rate > 1)
+	{
+		usage(argv[0]);
+		exit(1);
+	}
+
+	/* The automatic savepoint is only enabled in server mode */
+	keywords[0] = "dbname";
+	values[0] = optind < argc ? argv[optind] : "";
+	keywords[1] = "options";
+	values[1] = client_mode ? "" :
+		"-c session_preload_libraries=pg_statement_rollback -c pg_statement_rollback.enabled=on";
+	keywords[2] = NULL;
+	values[2] = NULL;
+
+	conn = PQconnectdbParams(keywords, values, 1);
+	if (PQstatus(conn) != CONNECTION_OK)
+		die("could not connect");
+
+	if (client_mode)
+		name = CLIENT_SAVEPOINT;
+	else
+		name = exec_simple("SHOW pg_statement_rollback.savepoint_name");
+	savepoint_name = PQescapeIdentifier(conn, name, strlen(name));
+	if (savepoint_name == NULL)
+		die("could not quote the savepoint name");
+	rollback_command = malloc(strlen(savepoint_name) + 32);
+	if (rollback_command == NULL)
+		die("out of memory");
+	sprintf(rollback_command, "ROLLBACK TO SAVEPOINT %s", savepoint_name);
+
+	exec_simple("CREATE TABLE IF NOT EXISTS slr_loadgen(id bigint, v integer CHECK (v >= 0))");
+	exec_simple("TRUNCATE slr_loadgen");
+	res = PQprepare(conn, "slr_loadgen_insert",
+					"INSERT INTO slr_loadgen VALUES ($1, $2)", 0, NULL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		die("could not prepare the statement");
+	PQclear(res);
+
+	if (!PQenterPipelineMode(conn))
+		die("could not enter pipeline mode");
+
+	nitems = nstatements + 2;
+	items = malloc(nitems * sizeof(Item));
+	if (items == NULL)
+		die("out of memory");
+
+	start = now_ms();
+	for (t = 0; t < ntransactions; t++)
+	{
+		items[0].kind = ITEM_BEGIN;
+		items[0].fail = 0;
+		for (i = 1; i <= nstatements; i++)
+		{
+			items[i].kind = ITEM_INSERT;
+			items[i].fail = rng_double() < error_rate;
+		}
+		items[nitems - 1].kind = ITEM_COMMIT;
+		items[nitems - 1].fail = 0;
+
+		nerrors += run_transaction(items, nitems, batch);
+	}
+	elapsed = now_ms() - start;
+
+	PQexitPipelineMode(conn);
+
+	printf("mode: %s\n", client_mode ? "client" : "server");
+	printf("savepoint: %s\n", savepoint_name);
+	printf("transactions: %d, statements per transaction: %d, batch: %d\n",
+		   ntransactions, nstatements, batch);
+	printf("errors injected: %d\n", nerrors);
+	printf("duration: %.3f s\n", elapsed / 1000);
+	printf("tps: %.1f\n", ntransactions * 1000.0 / elapsed);
+	printf("statements per second: %.1f\n",
+		   ((double) ntransactions * nstatements - nerrors) * 1000.0 / elapsed);
+	if (nrecoveries > 0)
+	{
+		for (i = 0; i < nrecoveries; i++)
+			total += recoveries[i];
+		qsort(recoveries, nrecoveries, sizeof(double), cmp_double);
+		printf("recovery latency: avg %.3f ms, p50 %.3f ms, p95 %.3f ms, max %.3f ms\n",
+			   total / nrecoveries, percentile(0.50), percentile(0.95),
+			   recoveries[nrecoveries - 1]);
+	}
+
+	free(items);
+	free(recoveries);
+	free(rollback_command);
+	PQfreemem(savepoint_name);
+	PQfinish(conn);
+
+	return 0;
+}
@@ -0,0 +1,112 @@
+/* pg_statement_rollback--1.5.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pg_statement_rollback" to load this file. \quit
+
+-- Automatic retry counters of the current backend
+CREATE FUNCTION pg_statement_rollback_retries(
+    OUT retries bigint,
+    OUT recovered bigint,
+    OUT exhausted bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- Memory retained by the automatic savepoints of the current transaction
+CREATE FUNCTION pg_statement_rollback_memory(
+    OUT released_savepoints bigint,
+    OUT retained_contexts bigint,
+    OUT retained_bytes bigint,
+    OUT transaction_bytes bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- Cluster wide statistics, the library must be in shared_preload_libraries
+CREATE FUNCTION pg_statement_rollback_stats(
+    OUT userid oid,
+    OUT dbid oid,
+    OUT savepoints bigint,
+    OUT released bigint,
+    OUT rolled_back bigint,
+    OUT rollovers bigint,
+    OUT rollovers_elided bigint,
+    OUT rollover_time double precision,
+    OUT stats_reset timestamp with time zone
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_statement_rollback_stats AS
+  SELECT * FROM pg_statement_rollback_stats();
+
+GRANT SELECT ON pg_statement_rollback_stats TO PUBLIC;
+
+CREATE FUNCTION pg_statement_rollback_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION pg_statement_rollback_stats_reset() FROM PUBLIC;
+
+-- Statistics per statement, joinable to pg_stat_statements
+CREATE FUNCTION pg_statement_rollback_query_stats(
+    OUT userid oid,
+    OUT dbid oid,
+    OUT queryid bigint,
+    OUT rollovers bigint,
+    OUT total_rollover_time double precision,
+    OUT max_rollover_time double precision,
+    OUT rolled_back bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW pg_statement_rollback_query_stats AS
+  SELECT * FROM pg_statement_rollback_query_stats();
+
+GRANT SELECT ON pg_statement_rollback_query_stats TO PUBLIC;
+
+-- Automatic savepoint state of the backends, joinable to pg_stat_activity
+CREATE FUNCTION pg_statement_rollback_backends(
+    OUT pid integer,
+    OUT dbid oid,
+    OUT depth integer,
+    OUT pending boolean,
+    OUT subxids integer,
+    OUT rollovers bigint,
+    OUT last_rollover timestamp with time zone
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- Latency histogram of the rollovers of the current backend
+CREATE FUNCTION pg_statement_rollback_latency(
+    OUT lower_us bigint,
+    OUT upper_us bigint,
+    OUT count bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- Last decisions of the extension in the current backend
+CREATE FUNCTION pg_statement_rollback_trace(
+    OUT seq bigint,
+    OUT event text,
+    OUT executor_level integer,
+    OUT planner_level integer,
+    OUT nest_level integer,
+    OUT pending boolean,
+    OUT deferred boolean,
+    OUT detail integer,
+    OUT sqlstate text
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
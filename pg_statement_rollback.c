@@ -12,18 +12,62 @@
  */
 #include "postgres.h"
 
+#include <ctype.h>
+#include <limits.h>
+
 #include "access/parallel.h"
 #include "access/xact.h"
+#include "commands/defrem.h"
 #include "commands/portalcmds.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_language.h"
+#include "catalog/pg_proc.h"
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#endif
 #include "executor/executor.h"
+#include "funcapi.h"
+#include "lib/stringinfo.h"
+#include "libpq/libpq.h"
+#include "miscadmin.h"
+#include "nodes/nodeFuncs.h"
 #include "nodes/pg_list.h"
 #include "optimizer/planner.h"
+#include "parser/scansup.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "portability/instr_time.h"
+#include "postmaster/autovacuum.h"
+#include "replication/walsender.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#if PG_VERSION_NUM >= 170000
+#include "storage/procnumber.h"
+#else
+#include "storage/backendid.h"
+#endif
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
 #include "tcop/utility.h"
+#include "utils/builtins.h"
 #include "utils/elog.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+#if PG_VERSION_NUM >= 100000
+#include "utils/varlena.h"
+#endif
 #if PG_VERSION_NUM < 110000
 #include "nodes/makefuncs.h"
-#include "utils/memutils.h"
 #endif
 
 #if PG_VERSION_NUM < 90500
@@ -74,10 +118,44 @@
 
 PG_MODULE_MAGIC;
 
+PG_FUNCTION_INFO_V1(pg_statement_rollback_retries);
+PG_FUNCTION_INFO_V1(pg_statement_rollback_memory);
+PG_FUNCTION_INFO_V1(pg_statement_rollback_stats);
+PG_FUNCTION_INFO_V1(pg_statement_rollback_stats_reset);
+PG_FUNCTION_INFO_V1(pg_statement_rollback_query_stats);
+PG_FUNCTION_INFO_V1(pg_statement_rollback_backends);
+PG_FUNCTION_INFO_V1(pg_statement_rollback_latency);
+PG_FUNCTION_INFO_V1(pg_statement_rollback_trace);
+
 #if PG_VERSION_NUM >= 90500
 #define IN_PARALLEL_WORKER (ParallelWorkerNumber >= 0)
 #endif
 
+/*
+ * Static tracepoints, only compiled in with make WITH_SDT=1.  All probes of
+ * the provider pg_statement_rollback receive the executor and planner nest
+ * levels and a detail depending on the event.
+ */
+#ifdef SLR_USE_SDT
+#include <sys/sdt.h>
+#define SLR_PROBE(name, detail) \
+	DTRACE_PROBE3(pg_statement_rollback, name, slr_nest_executor_level, \
+				  slr_nest_planner_level, (detail))
+#else
+#define SLR_PROBE(name, detail) ((void) 0)
+#endif
+
+/*
+ * Decision points: fire the probe and record the event in the trace buffer
+ * of the backend.
+ */
+#define SLR_TRACE(name, event, detail) \
+	do { \
+		SLR_PROBE(name, detail); \
+		if (slr_trace) \
+			slr_trace_record((event), (detail)); \
+	} while (0)
+
 /* Variables to saved hook values in case of unload */
 static planner_hook_type prev_planner_hook = NULL;
 static ExecutorStart_hook_type prev_ExecutorStart = NULL;
@@ -104,6 +182,12 @@ static void slr_ExecutorFinish(QueryDesc *queryDesc);
 static void slr_ProcessUtility(SLR_PROCESSUTILITY_PROTO);
 static PlannedStmt* slr_planner(SLR_PLANNERHOOK_PROTO);
 static void disable_differed_slr(ErrorData *edata);
+static void slr_xact_callback(XactEvent event, void *arg);
+static void slr_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+						SubTransactionId parentSubid, void *arg);
+static void slr_enabled_assign(bool newval, void *extra);
+static void slr_install_hooks(void);
+static void slr_uninstall_hooks(void);
 
 /* Functions */
 void	_PG_init(void);
@@ -112,8 +196,74 @@ void    slr_save_resowner(void);
 void    slr_restore_resowner(void);
 void    slr_add_savepoint(void);
 void    slr_release_savepoint(void);
-static void slr_log(const char *kind);
+void    slr_rollover_savepoint(void);
+static void slr_attach_savepoint(void);
+static void slr_release_before_client_savepoint(void);
+static void slr_log(const char *kind, double msec);
+static bool slr_log_sample(const char *kind);
+static void slr_log_summary_line(void);
+static void slr_trace_record(int event, int detail);
+static double slr_elapsed_ms(instr_time start);
+static void slr_latency_count(double msec);
 bool slr_is_write_query(QueryDesc *queryDesc);
+static bool slr_scan_write_query(QueryDesc *queryDesc);
+static int slr_query_entry_cmp(const void *a, const void *b);
+static void slr_query_cache_evict(void);
+static bool slr_relation_policy_active(void);
+static bool slr_savepoint_unused(Node *parsetree);
+static bool slr_rollover_due(void);
+static bool slr_utility_needs_savepoint(Node *parsetree);
+static bool slr_explain_no_analyze(Node *parsetree);
+static void *slr_guc_malloc(size_t size);
+static bool slr_check_skip_utilities(char **newval, void **extra, GucSource source);
+static void slr_assign_skip_utilities(const char *newval, void *extra);
+static bool slr_statement_opted_out(bool no_autosavepoint,
+									const char *sourceText, int stmt_location);
+static bool slr_relation_skipped(Oid relid);
+static bool slr_compute_relation_skipped(Oid relid);
+static void slr_relcache_callback(Datum arg, Oid relid);
+static void slr_syscache_callback(Datum arg, int cacheid, uint32 hashvalue);
+static bool slr_function_policy_active(void);
+static bool slr_plan_calls_writer(PlannedStmt *stmt);
+static bool slr_plan_walker(Plan *plan);
+static bool slr_expr_calls_writer(Node *node, void *context);
+static bool slr_function_may_write(Oid funcid, void *context);
+static bool slr_compute_function_may_write(Oid funcid);
+static bool slr_function_listed(const char *list, const char *nspname,
+		const char *proname);
+static void slr_proc_syscache_callback(Datum arg, int cacheid, uint32 hashvalue);
+static void slr_assign_function_bool(bool newval, void *extra);
+static void slr_assign_function_string(const char *newval, void *extra);
+static bool slr_statement_retryable(QueryDesc *queryDesc,
+						ScanDirection direction, uint64 count);
+static void slr_run_with_retry(QueryDesc *queryDesc);
+static void slr_run_statement_copy(QueryDesc *queryDesc, bool new_snapshot);
+static void slr_retry_wait(long delay_ms);
+static bool slr_error_retryable(ErrorData *edata);
+static void slr_account_released_level(int nestlevel);
+static bool slr_retained_memory_exceeded(void);
+static Size slr_stats_memsize(void);
+static void slr_shmem_request(void);
+static void slr_shmem_startup(void);
+static void slr_stats_count(int kind, double time);
+static void slr_query_stats_count(int kind, double time);
+static void slr_count_subxid(void);
+static void slr_query_stats_flush(void);
+static void slr_query_stats_add(slrQueryStatsEntry *entry,
+								slrQueryStatsPending *pending);
+static int	slr_max_backends(void);
+static void slr_backend_update(void);
+static void slr_backend_detach(int code, Datum arg);
+static void slr_stats_check(void);
+static void slr_assign_skip_rel_bool(bool newval, void *extra);
+static void slr_assign_skip_rel_string(const char *newval, void *extra);
+static char *slr_scan_identifier(const char **nextp);
+static bool slr_check_skip_relations(char **newval, void **extra, GucSource source);
+static void slr_assign_skip_relations(const char *newval, void *extra);
+static bool slr_next_stmt_ends_xact(const char *sourceText, int stmt_location,
+						int stmt_len);
+static bool slr_message_pending(const char *sourceText, int stmt_location,
+						int stmt_len);
 
 #if PG_VERSION_NUM >= 160000
 RTEPermissionInfo *localGetRTEPermissionInfo(List *rteperminfos, RangeTblEntry *rte);
@@ -127,12 +277,375 @@ bool    slr_pending = false; /* Has an automatic savepoint been created? */
 bool    slr_defered_save_resowner = false; /* has defered savepoint */
 bool    slr_enable_writeonly = true; /* create savepoint only on write command
 					tag (INSERT/DELETE/UPDATE) and DDL */
+bool    slr_lazy_savepoint = false; /* skip the rollover when the next statement
+					of the query string ends the transaction */
+bool    slr_reuse_savepoint = false; /* keep the automatic savepoint when
+					it has not been assigned a xid */
+int     slr_rollover_every = 1; /* renew the savepoint every N statements */
+int     slr_rollover_interval = 0; /* or every M milliseconds */
+bool    slr_rollover_per_message = false; /* one savepoint per query string or
+					pipeline segment */
+char    *slr_skip_utilities = NULL; /* additional utilities without savepoint */
+bool    slr_skip_temp_tables = false; /* writes to temp tables are not protected */
+bool    slr_skip_unlogged_tables = false; /* nor writes to unlogged tables */
+char    *slr_skip_schemas = NULL; /* nor writes to tables of these schemas */
+char    *slr_skip_relations = NULL; /* nor writes to these tables */
+bool    slr_no_autosavepoint = false; /* suspend the rollover, for SET LOCAL */
+bool    slr_volatile_c_functions_write = false; /* volatile C functions may write */
+char    *slr_write_functions = NULL; /* functions that may write to tables */
+char    *slr_readonly_functions = NULL; /* functions that never write */
+int     slr_auto_retry = 0; /* retries of statements failing on a lock */
+int     slr_auto_retry_delay = 10; /* delay before the first retry, in ms */
+bool    slr_flatten_savepoints = false; /* no automatic savepoint below the
+					client savepoints */
+bool    slr_hoist_planner_locks = false; /* planner locks are owned by the
+					transaction, not by the automatic savepoint */
+int     slr_max_retained_memory = 0; /* suspend the rollover past this amount
+					of memory retained by automatic savepoints, in kB */
+int     slr_stats_max = 1000; /* database and role pairs in shared memory */
+int     slr_stats_max_queries = 5000; /* and statements */
+bool    slr_log_summary = false; /* log a summary at the end of transactions */
+double  slr_log_sample_rate = 1.0; /* fraction of the orders logged */
+bool    slr_trace = false; /* record the decisions in the trace buffer */
 static int      slr_nest_executor_level = 0;
-static bool     slr_planner_done = false;
 static int      slr_nest_planner_level = 0;
+static int      slr_savepoint_nestlevel = 0; /* nest level of the automatic savepoint */
+static int      slr_stmt_count = 0; /* statements since the last rollover */
+static TimestampTz slr_last_rollover = 0; /* time of the last rollover */
+static char     *slr_skip_utilities_list = NULL; /* parsed skip_utilities */
+static char     *slr_skip_relations_list = NULL; /* parsed skip_relations */
+
+/*
+ * Executors started while a statement is being planned, to evaluate a
+ * function at plan time for example, must not touch the savepoints.  This
+ * only depends on the current nesting: cached plans of prepared statements
+ * are executed without calling the planner at all.
+ */
+#define SLR_IN_PLANNER()	(slr_nest_planner_level > 0)
+
+/*
+ * Cache of the relations whose writes do not need an automatic savepoint,
+ * invalidated by relcache and namespace syscache callbacks.
+ */
+typedef struct slrRelEntry
+{
+	Oid			relid;			/* hash key, must be first */
+	bool		skip;			/* writes do not need a savepoint */
+} slrRelEntry;
+
+static HTAB     *slr_rel_cache = NULL;
+static bool     slr_rel_cache_valid = false;
+
+/*
+ * Cache of the write classification of queries, keyed by queryId so that
+ * cached plans, prepared statements and statements executed in loops do not
+ * scan their range table each time.  It is reset when the relation or the
+ * function policy may have changed.  When it is full, the least recently
+ * used entries are evicted.
+ */
+#define SLR_QUERY_CACHE_MAX 1024
+#define SLR_QUERY_CACHE_EVICT 10	/* percentage of entries evicted */
+
+typedef struct slrQueryEntry
+{
+	uint64		queryid;		/* hash key, must be first */
+	bool		is_write;		/* the query writes to a table */
+	uint64		last_used;		/* slr_query_cache_clock at the last lookup */
+} slrQueryEntry;
+
+static HTAB     *slr_query_cache = NULL;
+static bool     slr_query_cache_valid = false;
+static uint64   slr_query_cache_clock = 0;
+
+/*
+ * Cache of the functions that may write to tables without going through the
+ * executor, invalidated by the pg_proc syscache callback.
+ */
+typedef struct slrFuncEntry
+{
+	Oid			funcid;			/* hash key, must be first */
+	bool		may_write;		/* a call needs the savepoint renewed */
+} slrFuncEntry;
+
+static HTAB     *slr_func_cache = NULL;
+static bool     slr_func_cache_valid = false;
+
+/*
+ * Resource owner of the locks taken by the planner, child of the top
+ * transaction's one, see slr_planner().  It is deleted with its parent at
+ * the end of the transaction.
+ */
+static ResourceOwner slr_planner_owner = NULL;
+
+/* Counters of the automatic retries of this backend */
+static int64    slr_retries = 0;	/* statements executed again */
+static int64    slr_retries_recovered = 0; /* succeeded after a retry */
+static int64    slr_retries_exhausted = 0; /* failed after all retries */
+
+/*
+ * Duration of the last RELEASE and SAVEPOINT of the automatic savepoint, the
+ * SAVEPOINT is only logged once the resource owner is restored.
+ */
+static double   slr_release_duration = 0;
+static double   slr_savepoint_duration = 0;
+
+/*
+ * Latency histogram of the rollovers of the backend, bucket i counts the
+ * rollovers lasting less than 2^i microseconds and at least half of it, the
+ * last bucket has no upper bound.
+ */
+#define SLR_LATENCY_BUCKETS		24
+static int64    slr_latency_histogram[SLR_LATENCY_BUCKETS];
+
+/*
+ * Orders of the automatic savepoint in the current transaction, for the
+ * summary logged at its end, and sampling of the orders logged.  The
+ * SAVEPOINT of a rollover follows the decision taken for its RELEASE.
+ */
+static int64    slr_summary_created = 0;
+static int64    slr_summary_released = 0;
+static int64    slr_summary_rolled_back = 0;
+static double   slr_summary_time = 0;
+static bool     slr_log_sampled = true;
+static bool     slr_log_after_release = false;
+
+/*
+ * Trace buffer: the last SLR_TRACE_SIZE decisions of the backend, returned
+ * by pg_statement_rollback_trace().  Recording an event is a few stores,
+ * there is no timestamp, events are numbered instead.
+ */
+#define SLR_TRACE_SIZE			256
+
+#define SLR_TRACE_PLANNER_ENTER		0
+#define SLR_TRACE_PLANNER_EXIT		1
+#define SLR_TRACE_EXECUTOR_ENTER	2
+#define SLR_TRACE_EXECUTOR_EXIT		3
+#define SLR_TRACE_SAVE_RESOWNER		4
+#define SLR_TRACE_RESTORE_RESOWNER	5
+#define SLR_TRACE_ADD_SAVEPOINT		6
+#define SLR_TRACE_RELEASE_SAVEPOINT	7
+#define SLR_TRACE_ROLLBACK_TO		8
+#define SLR_TRACE_DEFERRED_SET		9
+#define SLR_TRACE_DEFERRED_CLEAR	10
+
+static const char *const slr_trace_event_names[] = {
+	"planner_enter",
+	"planner_exit",
+	"executor_enter",
+	"executor_exit",
+	"save_resowner",
+	"restore_resowner",
+	"add_savepoint",
+	"release_savepoint",
+	"rollback_to",
+	"deferred_set",
+	"deferred_clear"
+};
+
+typedef struct slrTraceEntry
+{
+	uint64	seq;			/* event number in the backend */
+	int16	event;
+	int16	executor;		/* executor nest level */
+	int16	planner;		/* planner nest level */
+	int16	nestlevel;		/* transaction nest level */
+	bool	pending;
+	bool	deferred;
+	int32	detail;
+} slrTraceEntry;
+
+static slrTraceEntry slr_trace_buffer[SLR_TRACE_SIZE];
+static uint64   slr_trace_seq = 0;
+
+/*
+ * Memory retained by the automatic savepoints of the current transaction.
+ * A released subtransaction keeps its CurTransactionContext until the end of
+ * its parent when it is not empty, it holds the invalidation messages or the
+ * after trigger events of the statement for example.
+ */
+static int64    slr_released_savepoints = 0;	/* automatic savepoints released */
+static int64    slr_retained_contexts = 0;	/* contexts kept by them */
+static int64    slr_retained_bytes = 0;	/* and their size */
+static bool     slr_retained_warned = false; /* bound reached in this transaction */
+
+/*
+ * Before PostgreSQL 13 the size of a memory context can not be read, a
+ * retained context is counted for its first block.
+ */
+#if PG_VERSION_NUM >= 130000
+#define SLR_CONTEXT_BYTES(cxt) ((int64) MemoryContextMemAllocated((cxt), false))
+#else
+#define SLR_CONTEXT_BYTES(cxt) ((int64) ALLOCSET_DEFAULT_INITSIZE)
+#endif
+
+/*
+ * Utility statements that do not need the automatic savepoint to be renewed
+ * after them, because they have no effect that a ROLLBACK TO could undo.  An
+ * optional function can refine the decision from the parse tree.
+ */
+typedef struct slrUtilityClass
+{
+	NodeTag		tag;
+	bool		(*harmless) (Node *parsetree);
+} slrUtilityClass;
+
+static const slrUtilityClass slr_harmless_utilities[] =
+{
+	{T_ClosePortalStmt, NULL},		/* CLOSE */
+	{T_VariableShowStmt, NULL},		/* SHOW */
+	{T_ExplainStmt, slr_explain_no_analyze},	/* EXPLAIN without ANALYZE */
+	{T_PrepareStmt, NULL},			/* PREPARE, not transactional */
+	{T_DeallocateStmt, NULL},		/* DEALLOCATE, not transactional */
+	{T_LoadStmt, NULL},				/* LOAD */
+	{T_CheckPointStmt, NULL}		/* CHECKPOINT */
+};
 static ResourceOwner oldresowner = NULL;
 static ResourceOwner newresowner = NULL;
 static MemoryContext slrPortalContext = NULL;
+static bool     slr_hooks_installed = false;
+/* the hooks were removed, the state must be reset at the end of transaction */
+static bool     slr_reset_pending = false;
+
+/*
+ * Executor and planner nest levels saved at the start of each subtransaction,
+ * indexed by transaction nest level, so they can be restored when an error
+ * aborts the subtransaction.
+ */
+typedef struct slrNestLevels
+{
+	int		executor;
+	int		planner;
+	int64	retained_contexts;	/* contexts of released automatic savepoints */
+	int64	retained_bytes;		/* kept below this level's transaction context */
+	bool	xid_counted;		/* the xid of this level has been counted */
+} slrNestLevels;
+
+static slrNestLevels *slr_subxact_levels = NULL;
+static int      slr_subxact_levels_size = 0;
+
+/*
+ * Cluster wide statistics, kept in shared memory when the library is loaded
+ * with shared_preload_libraries.  Counters are accumulated per database and
+ * role in a hash table protected by a LWLock, each entry is updated under
+ * its own spinlock.  Entries are never removed, a reset only clears their
+ * counters, so a backend can keep a pointer to its current entry.
+ */
+typedef struct slrStatsKey
+{
+	Oid		dbid;
+	Oid		userid;
+} slrStatsKey;
+
+typedef struct slrStatsCounters
+{
+	int64	created;		/* automatic savepoints created */
+	int64	released;		/* automatic savepoints released */
+	int64	rolled_back;	/* rollbacks to the automatic savepoint */
+	int64	rollovers;		/* release and creation after a statement */
+	int64	elided;			/* rollovers skipped by a policy */
+	double	rollover_time;	/* time spent in rollovers, in ms */
+} slrStatsCounters;
+
+typedef struct slrStatsEntry
+{
+	slrStatsKey key;
+	slrStatsCounters counters;
+	slock_t	mutex;
+} slrStatsEntry;
+
+/*
+ * Statistics per statement, the queryId is the one of pg_stat_statements.
+ * Rollovers are attributed to the statement which triggered them, errors
+ * to the last top level statement executed when the transaction rolls back
+ * to the automatic savepoint.
+ */
+typedef struct slrQueryStatsKey
+{
+	Oid		dbid;
+	Oid		userid;
+	uint64	queryid;
+} slrQueryStatsKey;
+
+typedef struct slrQueryStatsEntry
+{
+	slrQueryStatsKey key;
+	int64	rollovers;		/* rollovers triggered by the statement */
+	double	total_time;		/* time spent in these rollovers, in ms */
+	double	max_time;		/* longest of them */
+	int64	rolled_back;	/* rollbacks to the automatic savepoint */
+	slock_t	mutex;
+} slrQueryStatsEntry;
+
+/*
+ * Statement counters of the current transaction not yet added to the shared
+ * hash table, they are flushed at the end of the transaction or when all the
+ * slots are used.
+ */
+typedef struct slrQueryStatsPending
+{
+	slrQueryStatsKey key;
+	int64	rollovers;
+	double	total_time;
+	double	max_time;
+	int64	rolled_back;
+} slrQueryStatsPending;
+
+#define SLR_QUERY_STATS_PENDING	16
+
+/*
+ * Live state of each backend, only written by its owner with plain stores
+ * and read without lock by pg_statement_rollback_backends(), the values of a
+ * slot may be slightly inconsistent with each other.  The pid is set last
+ * when the slot is claimed and cleared first when it is released.  The slots
+ * are indexed by backend number.
+ */
+typedef struct slrBackendState
+{
+	int		pid;			/* 0 when the slot is unused */
+	Oid		dbid;
+	int		depth;			/* open subtransactions */
+	bool	pending;		/* there is an automatic savepoint */
+	int		subxids;		/* subtransaction xids of the transaction */
+	int64	rollovers;		/* rollovers in the transaction */
+	TimestampTz last_rollover;
+} slrBackendState;
+
+typedef struct slrSharedState
+{
+	LWLock	   *lock;			/* protects the hash tables */
+	TimestampTz stats_reset;	/* last reset of the counters */
+	int		max_backends;		/* number of backend slots */
+} slrSharedState;
+
+#define SLR_STATS_CREATED		0
+#define SLR_STATS_RELEASED		1
+#define SLR_STATS_ROLLED_BACK	2
+#define SLR_STATS_ROLLOVER		3
+#define SLR_STATS_ELIDED		4
+
+#define SLR_STATS_COLS			9
+#define SLR_QUERY_STATS_COLS	7
+#define SLR_BACKENDS_COLS		7
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static slrSharedState *slr_shared = NULL;
+static HTAB     *slr_stats_hash = NULL;
+static slrStatsEntry *slr_stats_entry = NULL; /* entry of the backend */
+static slrStatsKey slr_stats_entry_key;
+static HTAB     *slr_query_stats_hash = NULL;
+static slrQueryStatsPending slr_query_stats_pending[SLR_QUERY_STATS_PENDING];
+static int      slr_query_stats_npending = 0;
+static uint64   slr_current_queryid = 0; /* last top level statement */
+static bool     slr_stmt_no_autosavepoint = false; /* no_autosavepoint when the
+					top level executor started */
+static slrBackendState *slr_backends = NULL;
+static slrBackendState *slr_my_backend = NULL; /* slot of the backend */
+static int      slr_xact_subxids = 0; /* subtransaction xids of the transaction */
+static int64    slr_xact_rollovers = 0; /* rollovers in the transaction */
+static TimestampTz slr_xact_last_rollover = 0;
 
 /*
  * Module load callback
@@ -140,28 +653,26 @@ static MemoryContext slrPortalContext = NULL;
 void
 _PG_init(void)
 {
-
 	/*
-	 * Install hooks.
+	 * Nest levels are reset or restored at end of (sub)transaction, which
+	 * avoids a PG_TRY block around each executor call.  Unlike the hooks,
+	 * the callbacks stay registered when the extension is disabled: they
+	 * can not be removed while a transaction may still end with our state
+	 * in it and they do nothing but resetting a few variables.
 	 */
-	prev_planner_hook = planner_hook;
-	planner_hook = slr_planner;
-	prev_ExecutorStart = ExecutorStart_hook;
-	ExecutorStart_hook = slr_ExecutorStart;
-	prev_ExecutorRun = ExecutorRun_hook;
-	ExecutorRun_hook = slr_ExecutorRun;
-	prev_ExecutorEnd = ExecutorEnd_hook;
-	ExecutorEnd_hook = slr_ExecutorEnd;
-	prev_ExecutorFinish = ExecutorFinish_hook;
-	ExecutorFinish_hook = slr_ExecutorFinish;
-	prev_ProcessUtility = ProcessUtility_hook;
-	ProcessUtility_hook = slr_ProcessUtility;
-	prev_log_hook = emit_log_hook;
-	emit_log_hook = disable_differed_slr;
+	RegisterXactCallback(slr_xact_callback, NULL);
+	RegisterSubXactCallback(slr_subxact_callback, NULL);
+
+	/* Invalidate the relation policy cache */
+	CacheRegisterRelcacheCallback(slr_relcache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(NAMESPACEOID, slr_syscache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(PROCOID, slr_proc_syscache_callback, (Datum) 0);
 
 	/*
 	 * Automatic savepoint
 	 *
+	 * Hooks are installed by the assign hook when the extension is enabled
+	 * and removed when it is disabled.
 	 */
 	DefineCustomBoolVariable(
 		"pg_statement_rollback.enabled",
@@ -172,7 +683,7 @@ _PG_init(void)
 		PGC_USERSET,    /* Any user can set it */
 		0,
 		NULL,           /* No check hook */
-		NULL,           /* No assign hook */
+		slr_enabled_assign,
 		NULL            /* No show hook */
 	);
 
@@ -206,671 +717,3869 @@ _PG_init(void)
 		NULL,           /* No assign hook */
 		NULL            /* No show hook */
 		);
-}
-
-/*
- * Module unload callback
- */
-void
-_PG_fini(void)
-{
-	/* Uninstall hooks. */
-	planner_hook = prev_planner_hook;
-	ExecutorStart_hook = prev_ExecutorStart;
-	ExecutorRun_hook = prev_ExecutorRun;
-	ExecutorFinish_hook = prev_ExecutorFinish;
-	ExecutorEnd_hook = prev_ExecutorEnd;
-	ProcessUtility_hook = prev_ProcessUtility;
-	emit_log_hook = prev_log_hook;
 
-}
+	DefineCustomBoolVariable(
+		"pg_statement_rollback.lazy_savepoint",
+		"Do not renew the automatic savepoint when the statement is followed,"
+		" in the same query string, by a statement ending the transaction.",
+		NULL,
+		&slr_lazy_savepoint,
+		false,
+		PGC_USERSET,    /* Any user can set it */
+		0,
+		NULL,           /* No check hook */
+		NULL,           /* No assign hook */
+		NULL            /* No show hook */
+		);
 
-/* Keep track that the planner stage is fully terminated */
-static PlannedStmt*
-slr_planner(SLR_PLANNERHOOK_PROTO)
-{
-	PlannedStmt *stmt;
+	DefineCustomBoolVariable(
+		"pg_statement_rollback.reuse_savepoint",
+		"Keep the current automatic savepoint instead of renewing it when"
+		" no transaction id has been assigned to it.",
+		NULL,
+		&slr_reuse_savepoint,
+		false,
+		PGC_USERSET,    /* Any user can set it */
+		0,
+		NULL,           /* No check hook */
+		NULL,           /* No assign hook */
+		NULL            /* No show hook */
+		);
 
-	/*
-	 * For planners at executor level 0, remember that
-	 * we didn't finish the planner stage yet
-	 */
-	if (slr_nest_executor_level == 0 && slr_nest_planner_level == 0)
-		slr_planner_done = false;
+	DefineCustomIntVariable(
+		"pg_statement_rollback.rollover_every",
+		"Renew the automatic savepoint only every N statements requiring it,"
+		" 0 disables this limit.",
+		NULL,
+		&slr_rollover_every,
+		1,
+		0,
+		INT_MAX,
+		PGC_USERSET,    /* Any user can set it */
+		0,
+		NULL,           /* No check hook */
+		NULL,           /* No assign hook */
+		NULL            /* No show hook */
+		);
 
-	slr_nest_planner_level++;
-	elog(DEBUG1, "RSL: increase nest planner level (slr_nest_executor_level %d, slr_nest_planner_level %d, slr_planner_done %d).",
-			slr_nest_executor_level, slr_nest_planner_level, slr_planner_done);
+	DefineCustomIntVariable(
+		"pg_statement_rollback.rollover_interval",
+		"Renew the automatic savepoint only when this amount of time has"
+		" elapsed since the previous one, 0 disables this limit.",
+		NULL,
+		&slr_rollover_interval,
+		0,
+		0,
+		INT_MAX,
+		PGC_USERSET,    /* Any user can set it */
+		GUC_UNIT_MS,
+		NULL,           /* No check hook */
+		NULL,           /* No assign hook */
+		NULL            /* No show hook */
+		);
 
-	if (prev_planner_hook)
-		stmt = prev_planner_hook(SLR_PLANNERHOOK_ARGS);
-	else
-		stmt = standard_planner(SLR_PLANNERHOOK_ARGS);
+	DefineCustomBoolVariable(
+		"pg_statement_rollback.rollover_per_message",
+		"Renew the automatic savepoint only after the last statement of a"
+		" simple query string or of a pipeline segment ending with Sync.",
+		NULL,
+		&slr_rollover_per_message,
+		false,
+		PGC_USERSET,    /* Any user can set it */
+		0,
+		NULL,           /* No check hook */
+		NULL,           /* No assign hook */
+		NULL            /* No show hook */
+		);
 
-	slr_nest_planner_level--;
+	DefineCustomStringVariable(
+		"pg_statement_rollback.skip_utilities",
+		"Comma separated list of command tags of utility statements that do"
+		" not renew the automatic savepoint, in addition to the built-in ones.",
+		NULL,
+		&slr_skip_utilities,
+		"",
+		PGC_USERSET,    /* Any user can set it */
+		0,
+		slr_check_skip_utilities,
+		slr_assign_skip_utilities,
+		NULL            /* No show hook */
+		);
 
-	/* Remember that the planner stage is now done */
-	if (slr_nest_executor_level == 0 && slr_nest_planner_level == 0)
-	{
-		elog(DEBUG1, "RSL: planner_hook mark planner stage as done.");
-		slr_planner_done = true;
-	}
+	DefineCustomBoolVariable(
+		"pg_statement_rollback.skip_temp_tables",
+		"Do not renew the automatic savepoint after statements that only"
+		" write to temporary tables.",
+		NULL,
+		&slr_skip_temp_tables,
+		false,
+		PGC_USERSET,    /* Any user can set it */
+		0,
+		NULL,           /* No check hook */
+		slr_assign_skip_rel_bool,
+		NULL            /* No show hook */
+		);
 
-	return stmt;
-}
+	DefineCustomBoolVariable(
+		"pg_statement_rollback.skip_unlogged_tables",
+		"Do not renew the automatic savepoint after statements that only"
+		" write to unlogged tables.",
+		NULL,
+		&slr_skip_unlogged_tables,
+		false,
+		PGC_USERSET,    /* Any user can set it */
+		0,
+		NULL,           /* No check hook */
+		slr_assign_skip_rel_bool,
+		NULL            /* No show hook */
+		);
 
-static void
-slr_ProcessUtility(SLR_PROCESSUTILITY_PROTO)
-{
-#if PG_VERSION_NUM >= 100000
-	Node *parsetree = pstmt->utilityStmt;
-#endif
-	bool release_add_savepoint = false;
-	bool add_savepoint = false;
+	DefineCustomStringVariable(
+		"pg_statement_rollback.skip_schemas",
+		"Comma separated list of schemas whose tables do not need the"
+		" automatic savepoint to be renewed when written.",
+		NULL,
+		&slr_skip_schemas,
+		"",
+		PGC_USERSET,    /* Any user can set it */
+		0,
+		NULL,           /* No check hook */
+		slr_assign_skip_rel_string,
+		NULL            /* No show hook */
+		);
 
-	/* SPI calls are internal */
-	if (dest->mydest == DestSPI
-#if PG_VERSION_NUM >= 90500
-			|| IN_PARALLEL_WORKER
-#endif
-		)
-	{
-		/* do nothing */
-	}
-	/*
-	 * save the current resowner, all caches are associated to it, it'll be
-	 * restored after the automatic SAVEPOINT will be created
-	 */
-	else if (IsA(parsetree, TransactionStmt))
-	{
-		TransactionStmt *stmt = (TransactionStmt *) parsetree;
-		char       *name = NULL;
-#if PG_VERSION_NUM < 110000
-		ListCell   *cell;
-#endif
+	DefineCustomStringVariable(
+		"pg_statement_rollback.skip_relations",
+		"Comma separated list of schema qualified tables that do not need"
+		" the automatic savepoint to be renewed when written.",
+		NULL,
+		&slr_skip_relations,
+		"",
+		PGC_USERSET,    /* Any user can set it */
+		0,
+		slr_check_skip_relations,
+		slr_assign_skip_relations,
+		NULL            /* No show hook */
+		);
+
+	DefineCustomBoolVariable(
+		"pg_statement_rollback.volatile_c_functions_write",
+		"With enable_writeonly, consider that volatile functions written in"
+		" C may write to tables.",
+		NULL,
+		&slr_volatile_c_functions_write,
+		false,
+		PGC_USERSET,    /* Any user can set it */
+		0,
+		NULL,           /* No check hook */
+		slr_assign_function_bool,
+		NULL            /* No show hook */
+		);
+
+	DefineCustomStringVariable(
+		"pg_statement_rollback.write_functions",
+		"Comma separated list of functions that may write to tables, the"
+		" automatic savepoint is renewed after statements calling them.",
+		NULL,
+		&slr_write_functions,
+		"",
+		PGC_USERSET,    /* Any user can set it */
+		0,
+		NULL,           /* No check hook */
+		slr_assign_function_string,
+		NULL            /* No show hook */
+		);
+
+	DefineCustomStringVariable(
+		"pg_statement_rollback.readonly_functions",
+		"Comma separated list of functions that never write to tables.",
+		NULL,
+		&slr_readonly_functions,
+		"",
+		PGC_USERSET,    /* Any user can set it */
+		0,
+		NULL,           /* No check hook */
+		slr_assign_function_string,
+		NULL            /* No show hook */
+		);
+
+	DefineCustomIntVariable(
+		"pg_statement_rollback.auto_retry",
+		"Number of times a write statement failing on a deadlock or a lock"
+		" timeout is executed again inside the transaction.",
+		"Zero disables the automatic retry.  Otherwise each write statement"
+		" that can be retried runs in an internal subtransaction, even"
+		" when it does not conflict.",
+		&slr_auto_retry,
+		0,
+		0,
+		INT_MAX,
+		PGC_USERSET,    /* Any user can set it */
+		0,
+		NULL,           /* No check hook */
+		NULL,           /* No assign hook */
+		NULL            /* No show hook */
+		);
+
+	DefineCustomIntVariable(
+		"pg_statement_rollback.auto_retry_delay",
+		"Delay before the first automatic retry, multiplied by the number of"
+		" the attempt for the next ones.",
+		NULL,
+		&slr_auto_retry_delay,
+		10,
+		0,
+		60000,
+		PGC_USERSET,    /* Any user can set it */
+		GUC_UNIT_MS,
+		NULL,           /* No check hook */
+		NULL,           /* No assign hook */
+		NULL            /* No show hook */
+		);
+
+	DefineCustomBoolVariable(
+		"pg_statement_rollback.flatten_savepoints",
+		"Keep a single automatic savepoint above the client savepoints"
+		" instead of one below each of them.",
+		NULL,
+		&slr_flatten_savepoints,
+		false,
+		PGC_USERSET,    /* Any user can set it */
+		0,
+		NULL,           /* No check hook */
+		NULL,           /* No assign hook */
+		NULL            /* No show hook */
+		);
+
+	DefineCustomBoolVariable(
+		"pg_statement_rollback.hoist_planner_locks",
+		"Keep the locks taken by the planner in a resource owner of the"
+		" transaction so that the cost of the automatic savepoint release"
+		" does not depend on the number of locks held.",
+		NULL,
+		&slr_hoist_planner_locks,
+		false,
+		PGC_USERSET,    /* Any user can set it */
+		0,
+		NULL,           /* No check hook */
+		NULL,           /* No assign hook */
+		NULL            /* No show hook */
+		);
+
+	DefineCustomIntVariable(
+		"pg_statement_rollback.max_retained_memory",
+		"Stop renewing the automatic savepoint when the memory retained by"
+		" the released ones exceeds this amount, 0 disables this limit.",
+		NULL,
+		&slr_max_retained_memory,
+		0,
+		0,
+		MAX_KILOBYTES,
+		PGC_USERSET,    /* Any user can set it */
+		GUC_UNIT_KB,
+		NULL,           /* No check hook */
+		NULL,           /* No assign hook */
+		NULL            /* No show hook */
+		);
+
+	DefineCustomBoolVariable(
+		"pg_statement_rollback.log_summary",
+		"Log a summary of the automatic savepoint orders at the end of each"
+		" transaction instead of the orders themselves.",
+		NULL,
+		&slr_log_summary,
+		false,
+		PGC_SUSET,      /* Like the other logging settings */
+		0,
+		NULL,           /* No check hook */
+		NULL,           /* No assign hook */
+		NULL            /* No show hook */
+		);
+
+	DefineCustomRealVariable(
+		"pg_statement_rollback.log_sample_rate",
+		"Fraction of the automatic savepoint orders to log.",
+		NULL,
+		&slr_log_sample_rate,
+		1.0,
+		0.0,
+		1.0,
+		PGC_SUSET,      /* Like the other logging settings */
+		0,
+		NULL,           /* No check hook */
+		NULL,           /* No assign hook */
+		NULL            /* No show hook */
+		);
+
+	DefineCustomBoolVariable(
+		"pg_statement_rollback.trace",
+		"Record the last decisions of the extension in a buffer of the"
+		" backend.",
+		NULL,
+		&slr_trace,
+		false,
+		PGC_USERSET,    /* Any user can set it */
+		0,
+		NULL,           /* No check hook */
+		NULL,           /* No assign hook */
+		NULL            /* No show hook */
+		);
+
+	DefineCustomBoolVariable(
+		"pg_statement_rollback.no_autosavepoint",
+		"Do not renew the automatic savepoint after statements, meant to be"
+		" used with SET LOCAL for the rest of a transaction.",
+		NULL,
+		&slr_no_autosavepoint,
+		false,
+		PGC_USERSET,    /* Any user can set it */
+		0,
+		NULL,           /* No check hook */
+		NULL,           /* No assign hook */
+		NULL            /* No show hook */
+		);
+
+	DefineCustomIntVariable(
+		"pg_statement_rollback.stats_max",
+		"Maximum number of database and role pairs with statistics.",
+		NULL,
+		&slr_stats_max,
+		1000,
+		100,
+		INT_MAX / 2,
+		PGC_POSTMASTER, /* Shared memory is sized at startup */
+		0,
+		NULL,           /* No check hook */
+		NULL,           /* No assign hook */
+		NULL            /* No show hook */
+		);
+
+	DefineCustomIntVariable(
+		"pg_statement_rollback.stats_max_queries",
+		"Maximum number of statements with statistics.",
+		NULL,
+		&slr_stats_max_queries,
+		5000,
+		100,
+		INT_MAX / 2,
+		PGC_POSTMASTER, /* Shared memory is sized at startup */
+		0,
+		NULL,           /* No check hook */
+		NULL,           /* No assign hook */
+		NULL            /* No show hook */
+		);
+
+	/*
+	 * Statistics are only available when the library is preloaded, shared
+	 * memory can not be requested later.
+	 */
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = slr_shmem_request;
+#else
+	slr_shmem_request();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = slr_shmem_startup;
+}
+
+/*
+ * Module unload callback
+ */
+void
+_PG_fini(void)
+{
+	/* Uninstall hooks. */
+	slr_uninstall_hooks();
+	UnregisterXactCallback(slr_xact_callback, NULL);
+	UnregisterSubXactCallback(slr_subxact_callback, NULL);
+}
+
+/*
+ * Assign hook for pg_statement_rollback.enabled: install the hooks when the
+ * extension is enabled and remove them when it is disabled, so that sessions
+ * not using the feature do not pay for it.
+ */
+static void
+slr_enabled_assign(bool newval, void *extra)
+{
+	if (newval)
+		slr_install_hooks();
+	else
+		slr_uninstall_hooks();
+}
+
+static void
+slr_install_hooks(void)
+{
+	if (slr_hooks_installed)
+		return;
+
+	prev_planner_hook = planner_hook;
+	planner_hook = slr_planner;
+	prev_ExecutorStart = ExecutorStart_hook;
+	ExecutorStart_hook = slr_ExecutorStart;
+	prev_ExecutorRun = ExecutorRun_hook;
+	ExecutorRun_hook = slr_ExecutorRun;
+	prev_ExecutorEnd = ExecutorEnd_hook;
+	ExecutorEnd_hook = slr_ExecutorEnd;
+	prev_ExecutorFinish = ExecutorFinish_hook;
+	ExecutorFinish_hook = slr_ExecutorFinish;
+	prev_ProcessUtility = ProcessUtility_hook;
+	ProcessUtility_hook = slr_ProcessUtility;
+	prev_log_hook = emit_log_hook;
+	emit_log_hook = disable_differed_slr;
+
+	/*
+	 * We may be called from inside an executor, the BEGIN of the current
+	 * transaction has not been seen so nothing will be done before the next
+	 * transaction.
+	 */
+	slr_hooks_installed = true;
+}
+
+static void
+slr_uninstall_hooks(void)
+{
+	if (!slr_hooks_installed)
+		return;
+
+	/*
+	 * If another module has installed its hooks after ours we can not remove
+	 * them without breaking the chain, keep them, they are no-op when the
+	 * extension is disabled.
+	 */
+	if (planner_hook != slr_planner ||
+			ExecutorStart_hook != slr_ExecutorStart ||
+			ExecutorRun_hook != slr_ExecutorRun ||
+			ExecutorFinish_hook != slr_ExecutorFinish ||
+			ExecutorEnd_hook != slr_ExecutorEnd ||
+			ProcessUtility_hook != slr_ProcessUtility ||
+			emit_log_hook != disable_differed_slr)
+		return;
+
+	planner_hook = prev_planner_hook;
+	ExecutorStart_hook = prev_ExecutorStart;
+	ExecutorRun_hook = prev_ExecutorRun;
+	ExecutorFinish_hook = prev_ExecutorFinish;
+	ExecutorEnd_hook = prev_ExecutorEnd;
+	ProcessUtility_hook = prev_ProcessUtility;
+	emit_log_hook = prev_log_hook;
+
+	/*
+	 * Transaction boundaries are not tracked anymore, forget about the
+	 * current one.  An existing automatic savepoint will be released with
+	 * the transaction.
+	 */
+	slr_xact_opened = false;
+	slr_pending = false;
+	slr_defered_save_resowner = false;
+	slr_hooks_installed = false;
+	slr_reset_pending = true;
+}
+
+/*
+ * Transaction callback: nest levels can not be trusted after an error as
+ * there is no PG_TRY block around executor calls, reset everything at end of
+ * transaction.  Nothing is done while the hooks are not installed, once the
+ * state left by the transaction that removed them has been reset.
+ */
+static void
+slr_xact_callback(XactEvent event, void *arg)
+{
+	if (!slr_hooks_installed && !slr_reset_pending)
+		return;
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PREPARE:
+#if PG_VERSION_NUM >= 90500
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_PARALLEL_ABORT:
+#endif
+			if (slr_log_summary)
+				slr_log_summary_line();
+			slr_summary_created = 0;
+			slr_summary_released = 0;
+			slr_summary_rolled_back = 0;
+			slr_summary_time = 0;
+			slr_nest_executor_level = 0;
+			slr_nest_planner_level = 0;
+			slr_xact_opened = false;
+			slr_pending = false;
+			slr_planner_owner = NULL;
+			slr_released_savepoints = 0;
+			slr_retained_contexts = 0;
+			slr_retained_bytes = 0;
+			slr_retained_warned = false;
+			if (slr_subxact_levels != NULL)
+			{
+				slr_subxact_levels[1].retained_contexts = 0;
+				slr_subxact_levels[1].retained_bytes = 0;
+			}
+			slr_xact_subxids = 0;
+			slr_xact_rollovers = 0;
+			slr_xact_last_rollover = 0;
+			slr_backend_update();
+			slr_query_stats_flush();
+			slr_reset_pending = false;
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Subtransaction callback: remember the nest levels when a subtransaction
+ * starts and restore them if it is aborted, for example when an error is
+ * trapped by a PL/pgSQL exception block.  The levels are only tracked while
+ * the hooks are installed.
+ */
+static void
+slr_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+						SubTransactionId parentSubid, void *arg)
+{
+	int		nestlevel;
+
+	if (!slr_hooks_installed)
+		return;
+
+	nestlevel = GetCurrentTransactionNestLevel();
+	switch (event)
+	{
+		case SUBXACT_EVENT_START_SUB:
+			if (nestlevel >= slr_subxact_levels_size)
+			{
+				int		newsize = Max(16, nestlevel * 2);
+
+				if (slr_subxact_levels == NULL)
+					slr_subxact_levels = (slrNestLevels *)
+						MemoryContextAllocZero(TopMemoryContext,
+										   newsize * sizeof(slrNestLevels));
+				else
+					slr_subxact_levels = (slrNestLevels *)
+						repalloc(slr_subxact_levels,
+								 newsize * sizeof(slrNestLevels));
+				slr_subxact_levels_size = newsize;
+			}
+			slr_subxact_levels[nestlevel].executor = slr_nest_executor_level;
+			slr_subxact_levels[nestlevel].planner = slr_nest_planner_level;
+			slr_subxact_levels[nestlevel].retained_contexts = 0;
+			slr_subxact_levels[nestlevel].retained_bytes = 0;
+			slr_subxact_levels[nestlevel].xid_counted = false;
+			break;
+		case SUBXACT_EVENT_COMMIT_SUB:
+			if (nestlevel < slr_subxact_levels_size && nestlevel > 1)
+				slr_account_released_level(nestlevel);
+			slr_count_subxid();
+			break;
+		case SUBXACT_EVENT_ABORT_SUB:
+			if (nestlevel < slr_subxact_levels_size)
+			{
+				slr_nest_executor_level = slr_subxact_levels[nestlevel].executor;
+				slr_nest_planner_level = slr_subxact_levels[nestlevel].planner;
+
+				/* The contexts kept below this level are freed with it */
+				slr_retained_contexts -= slr_subxact_levels[nestlevel].retained_contexts;
+				slr_retained_bytes -= slr_subxact_levels[nestlevel].retained_bytes;
+				slr_subxact_levels[nestlevel].retained_contexts = 0;
+				slr_subxact_levels[nestlevel].retained_bytes = 0;
+			}
+			slr_count_subxid();
+			break;
+		default:
+			break;
+	}
+
+	slr_backend_update();
+}
+
+/*
+ * Keep track of the planner nesting, on error the level is restored by the
+ * (sub)transaction callbacks.
+ *
+ * When the automatic savepoint is released, the locks of its resource owner
+ * are reassigned to the parent.  Past 15 locks, lmgr scans all the locks of
+ * the backend to do it, so with statements planned on many partitions each
+ * rollover costs as much as the number of locks held by the transaction.
+ * With hoist_planner_locks, top level statements are planned with a resource
+ * owner of the top transaction which is never released before its end: the
+ * automatic savepoint only owns the few locks taken by the parser.  Those
+ * locks are not released by a ROLLBACK TO the automatic savepoint.
+ */
+static PlannedStmt*
+slr_planner(SLR_PLANNERHOOK_PROTO)
+{
+	PlannedStmt *stmt;
+	ResourceOwner oldowner = CurrentResourceOwner;
+	bool		hoist;
+
+	hoist = slr_enabled && slr_hoist_planner_locks && !IN_PARALLEL_WORKER &&
+		slr_nest_executor_level == 0 && slr_nest_planner_level == 0 &&
+		slr_xact_opened && slr_pending &&
+		slr_savepoint_nestlevel == GetCurrentTransactionNestLevel();
+
+	slr_nest_planner_level++;
+	SLR_TRACE(planner__enter, SLR_TRACE_PLANNER_ENTER, hoist);
+	elog(DEBUG1, "RSL: increase nest planner level (slr_nest_executor_level %d, slr_nest_planner_level %d).",
+			slr_nest_executor_level, slr_nest_planner_level);
+
+	if (hoist)
+	{
+		if (slr_planner_owner == NULL)
+			slr_planner_owner = ResourceOwnerCreate(TopTransactionResourceOwner,
+													"pg_statement_rollback planner");
+		CurrentResourceOwner = slr_planner_owner;
+
+		PG_TRY();
+		{
+			if (prev_planner_hook)
+				stmt = prev_planner_hook(SLR_PLANNERHOOK_ARGS);
+			else
+				stmt = standard_planner(SLR_PLANNERHOOK_ARGS);
+		}
+		PG_CATCH();
+		{
+			/*
+			 * Release what the planner did not have a chance to release,
+			 * the locks taken for the previous statements must be kept.
+			 */
+			ResourceOwnerRelease(slr_planner_owner,
+								 RESOURCE_RELEASE_BEFORE_LOCKS, false, false);
+			ResourceOwnerRelease(slr_planner_owner,
+								 RESOURCE_RELEASE_AFTER_LOCKS, false, false);
+			CurrentResourceOwner = oldowner;
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		CurrentResourceOwner = oldowner;
+	}
+	else if (prev_planner_hook)
+		stmt = prev_planner_hook(SLR_PLANNERHOOK_ARGS);
+	else
+		stmt = standard_planner(SLR_PLANNERHOOK_ARGS);
+
+	slr_nest_planner_level--;
+	SLR_TRACE(planner__exit, SLR_TRACE_PLANNER_EXIT, 0);
+	elog(DEBUG1, "RSL: decrease nest planner level (slr_nest_executor_level %d, slr_nest_planner_level %d).",
+			slr_nest_executor_level, slr_nest_planner_level);
+
+	return stmt;
+}
+
+static void
+slr_ProcessUtility(SLR_PROCESSUTILITY_PROTO)
+{
+#if PG_VERSION_NUM >= 100000
+	Node *parsetree = pstmt->utilityStmt;
+#endif
+	bool release_add_savepoint = false;
+	bool add_savepoint = false;
+	bool rollback_to_savepoint = false;
+	bool rollover_wanted;
+	/*
+	 * The opt-out setting in effect when the statement starts: a SET of
+	 * no_autosavepoint must itself be followed by a rollover, otherwise a
+	 * ROLLBACK TO the automatic savepoint would undo it.
+	 */
+	bool no_autosavepoint = slr_no_autosavepoint;
+
+	/* SPI calls are internal */
+	if (dest->mydest == DestSPI
+#if PG_VERSION_NUM >= 90500
+			|| IN_PARALLEL_WORKER
+#endif
+		)
+	{
+		/* do nothing */
+	}
+	/*
+	 * save the current resowner, all caches are associated to it, it'll be
+	 * restored after the automatic SAVEPOINT will be created
+	 */
+	else if (IsA(parsetree, TransactionStmt))
+	{
+		TransactionStmt *stmt = (TransactionStmt *) parsetree;
+		char       *name = NULL;
+#if PG_VERSION_NUM < 110000
+		ListCell   *cell;
+#endif
 
 		/* detect if we are in a transaction or not */
 		switch (stmt->kind)
 		{
-			case TRANS_STMT_PREPARE:
-				/* Savepoints do not work with 2PC, so disable automatic
-				 * savepoint.  Since a PREPARE TRANSACTION will actually
-				 * detach the transaction from the current session, the
-				 * transaction is not opened anymore anyway. */
-				elog(DEBUG1, "RSL: mark the transaction as closed with PREPARE.");
-				slr_xact_opened = false;
-				break;
-			case TRANS_STMT_BEGIN:
-			case TRANS_STMT_START:
-				elog( DEBUG1, "RSL: start transaction (slr_nest_executor_level %d, slr_xact_opened %d, kind %d).",
-						slr_nest_executor_level, slr_xact_opened, stmt->kind);
-				/*
-				* we'll need to add a savepoint after the utility execution,
-				* but only if this is a top level statement, and we're not
-				* already in transaction
-				*/
-				if (slr_enabled && slr_nest_executor_level == 0 && !slr_xact_opened)
-					add_savepoint = true;
+			case TRANS_STMT_PREPARE:
+				/* Savepoints do not work with 2PC, so disable automatic
+				 * savepoint.  Since a PREPARE TRANSACTION will actually
+				 * detach the transaction from the current session, the
+				 * transaction is not opened anymore anyway. */
+				elog(DEBUG1, "RSL: mark the transaction as closed with PREPARE.");
+				slr_xact_opened = false;
+				break;
+			case TRANS_STMT_BEGIN:
+			case TRANS_STMT_START:
+				elog( DEBUG1, "RSL: start transaction (slr_nest_executor_level %d, slr_xact_opened %d, kind %d).",
+						slr_nest_executor_level, slr_xact_opened, stmt->kind);
+				/*
+				* we'll need to add a savepoint after the utility execution,
+				* but only if this is a top level statement, and we're not
+				* already in transaction
+				*/
+				if (slr_enabled && slr_nest_executor_level == 0 && !slr_xact_opened)
+					add_savepoint = true;
+
+				/* mark the transaction as opened in all cases */
+				elog(DEBUG1, "RSL: mark the transaction as opened with BEGIN/START.");
+				slr_xact_opened = true;
+				break;
+			case TRANS_STMT_COMMIT:
+			case TRANS_STMT_COMMIT_PREPARED:
+			case TRANS_STMT_ROLLBACK_PREPARED:
+			case TRANS_STMT_ROLLBACK:
+				elog(DEBUG1, "RSL: mark the transaction as closed with ROLLBACK.");
+				slr_xact_opened = false;
+				/* any existing SAVEPOINT will automatically be released */
+				slr_pending = false;
+				break;
+			case TRANS_STMT_SAVEPOINT:
+				/* At this point, previous command (either DML or utility) will
+				* have opened a SAVEPOINT (if a transaction is opened,
+				* otherwise client's SAVEPOINT order will fail anyway).
+				*
+				* So if client send a SAVEPOINT order, next
+				* slr_release_savepoint will release both our savepoint and
+				* the client's one, since the client's one will be contained
+				* in our own.  We could release our own now, but if the
+				* command fails for any reason, the transaction will be
+				* irrevocably dead.
+				*
+				* So our only option is to force adding our own savepoint
+				* a second time after user's one if it succeed, but without
+				* releasing it before.  This will
+				* keep client's savepoint alive and still being able to do our
+				* statement rollback.  Unfortunately, it means that we'll have
+				* to pile up as many automatic savepoints as the client runs
+				* SAVEPOINT commands in its transaction.
+				*
+				* We will not issue the SAVEPOINT if the client is using the
+				* same SAVEPOINT name as our automatic SAVEPOINT/
+				*
+				* With flatten_savepoints, our savepoint is released before
+				* the client's one instead, so that the automatic savepoints
+				* do not pile up.  The RELEASE would have been done after this
+				* statement anyway.
+				*/
+#if PG_VERSION_NUM >= 110000
+				name = pstrdup(stmt->savepoint_name);
+#else
+				foreach(cell, stmt->options)
+				{
+					DefElem    *elem = lfirst(cell);
+
+					if (strcmp(elem->defname, "savepoint_name") == 0)
+						name = strVal(elem->arg);
+				}
+#endif
+				if (slr_enabled && name != NULL &&
+						strcmp(name, slr_savepoint_name) != 0)
+				{
+					add_savepoint = true;
+					if (slr_flatten_savepoints)
+						slr_release_before_client_savepoint();
+				}
+				break;
+			case TRANS_STMT_RELEASE:
+			case TRANS_STMT_ROLLBACK_TO:
+				/*
+				 * explicit SAVEPOINT handling, nothing to do unless the
+				 * automatic savepoints are flattened: RELEASE or ROLLBACK TO
+				 * of a client savepoint also destroys the automatic
+				 * savepoint above it, create a new one.  A ROLLBACK TO the
+				 * automatic savepoint is traced and counted in the
+				 * statistics.
+				 */
+#if PG_VERSION_NUM >= 110000
+				name = stmt->savepoint_name;
+#else
+				foreach(cell, stmt->options)
+				{
+					DefElem    *elem = lfirst(cell);
+
+					if (strcmp(elem->defname, "savepoint_name") == 0)
+						name = strVal(elem->arg);
+				}
+#endif
+				if (name == NULL || !slr_enabled || !slr_xact_opened)
+					break;
+				if (strcmp(name, slr_savepoint_name) != 0)
+					add_savepoint = slr_flatten_savepoints;
+				else if (stmt->kind == TRANS_STMT_ROLLBACK_TO)
+					rollback_to_savepoint = true;
+				break;
+			default:
+				elog(ERROR, "RSL: Unexpected transaction kind %d.", stmt->kind);
+				break;
+		}
+	}
+	else if (IsA(parsetree, FetchStmt))
+	{
+		/* do nothing if it's a FETCH */
+	}
+	else if (slr_enabled && ( IsA(parsetree, DeclareCursorStmt) ||
+				IsA(parsetree, PlannedStmt) ) )
+	{
+		/* The automatic savepoint is required for DECLARE not PLANNED */
+		release_add_savepoint = IsA(parsetree, DeclareCursorStmt);
+
+	}
+	else if (slr_enable_writeonly && IsA(parsetree, ExecuteStmt))
+	{
+		/*
+		 * EXECUTE of a prepared statement: the executor of the statement
+		 * tells if it writes through slr_defered_save_resowner.
+		 */
+	}
+	else if (slr_utility_needs_savepoint(parsetree))
+	{
+		/*
+		 * release automatic savepoint if any, and create a new one.
+		 * We don't check for the planner stage here, since utilities
+		 * go straight from parsing to executor without a planner stage.
+		 */
+		if (slr_enabled && slr_nest_executor_level == 0)
+		{
+			release_add_savepoint = true;
+
+			elog(DEBUG1, "RSL: ProcessUtility statement type %d, release and add savepoint.",
+					parsetree->type);
+		}
+	}
+
+#if PG_VERSION_NUM >= 100000
+	if (slr_nest_executor_level == 0 && !IsA(parsetree, TransactionStmt) &&
+			dest->mydest != DestSPI)
+		slr_current_queryid = pstmt->queryId;
+#endif
+
+	/* Continue the execution of the query */
+	slr_nest_executor_level++;
+	SLR_TRACE(executor__enter, SLR_TRACE_EXECUTOR_ENTER, (int) nodeTag(parsetree));
+
+	elog(DEBUG1, "SLR DEBUG: restore ProcessUtility.");
+	/*
+	 * Excecute the utility command, we are not concerned.  On error the nest
+	 * level is restored by the (sub)transaction callbacks.
+	 */
+	if (prev_ProcessUtility)
+		prev_ProcessUtility(SLR_PROCESSUTILITY_ARGS);
+	else
+		standard_ProcessUtility(SLR_PROCESSUTILITY_ARGS);
+	slr_nest_executor_level--;
+	SLR_TRACE(executor__exit, SLR_TRACE_EXECUTOR_EXIT, (int) nodeTag(parsetree));
+
+	/* SPI calls are internal */
+	if (dest->mydest == DestSPI
+#if PG_VERSION_NUM >= 90500
+			|| IN_PARALLEL_WORKER
+#endif
+			)
+	{
+		/* do nothing and get out */
+		return;
+	}
+
+	if (rollback_to_savepoint)
+	{
+		SLR_TRACE(rollback__to, SLR_TRACE_ROLLBACK_TO,
+				  GetCurrentTransactionNestLevel());
+		slr_stats_count(SLR_STATS_ROLLED_BACK, 0);
+		slr_summary_rolled_back++;
+	}
+
+	rollover_wanted = release_add_savepoint || add_savepoint ||
+		slr_defered_save_resowner;
+
+#if PG_VERSION_NUM >= 100000
+	/*
+	 * In lazy mode there is no need to renew the automatic savepoint if the
+	 * next statement of the query string terminates the transaction, it would
+	 * be thrown away immediately.
+	 */
+	if (slr_lazy_savepoint &&
+			(release_add_savepoint || add_savepoint || slr_defered_save_resowner) &&
+			slr_next_stmt_ends_xact(queryString, pstmt->stmt_location, pstmt->stmt_len))
+	{
+		elog(DEBUG1, "RSL: ProcessUtility skip automatic savepoint, next statement ends the transaction.");
+		release_add_savepoint = false;
+		add_savepoint = false;
+		slr_defered_save_resowner = false;
+	}
+#endif
+
+	/* The statement or the transaction has opted out of the rollover */
+	if ((release_add_savepoint || slr_defered_save_resowner) &&
+			slr_statement_opted_out(no_autosavepoint, queryString,
+#if PG_VERSION_NUM >= 100000
+				pstmt->stmt_location
+#else
+				0
+#endif
+				))
+	{
+		elog(DEBUG1, "RSL: ProcessUtility automatic savepoint disabled for this statement.");
+		release_add_savepoint = false;
+		slr_defered_save_resowner = false;
+	}
+
+	/* Keep the automatic savepoint if nothing has been done under it */
+	if ((release_add_savepoint || slr_defered_save_resowner) &&
+			slr_savepoint_unused(parsetree))
+	{
+		elog(DEBUG1, "RSL: ProcessUtility keep unused automatic savepoint.");
+		release_add_savepoint = false;
+		slr_defered_save_resowner = false;
+	}
+
+#if PG_VERSION_NUM >= 100000
+	/* The whole client message is the recovery unit */
+	if ((release_add_savepoint || slr_defered_save_resowner) &&
+			slr_message_pending(queryString, pstmt->stmt_location, pstmt->stmt_len))
+	{
+		elog(DEBUG1, "RSL: ProcessUtility automatic savepoint deferred to the end of the message.");
+		release_add_savepoint = false;
+		slr_defered_save_resowner = false;
+	}
+#endif
+
+	/* Renew the savepoint only every N statements or M milliseconds */
+	if ((release_add_savepoint || slr_defered_save_resowner) &&
+			!slr_rollover_due())
+	{
+		elog(DEBUG1, "RSL: ProcessUtility automatic savepoint renewal not due.");
+		release_add_savepoint = false;
+		slr_defered_save_resowner = false;
+	}
+
+	if (rollover_wanted && !release_add_savepoint && !add_savepoint &&
+			!slr_defered_save_resowner)
+	{
+		slr_stats_count(SLR_STATS_ELIDED, 0);
+		slr_backend_update();
+	}
+
+	/*
+	 * RELEASE and add a SAVEPOINT if we just executed a statement
+	 * that should not rollback on failure of future statement failures
+	 */
+	if (release_add_savepoint)
+	{
+		elog(DEBUG1, "RSL: ProcessUtility release and add savepoint (slr_nest_executor_level %d, slr_nest_planner_level %d).",
+				slr_nest_executor_level, slr_nest_planner_level);
+		release_add_savepoint = false;
+		/*
+		 * save the current resowner, all caches are associated to it, it'll be
+		 * restored after the automatic SAVEPOINT will be created
+		 */
+		slr_save_resowner();
+		/* Release an automatic SAVEPOINT if there's one and create a new one */
+		slr_rollover_savepoint();
+	}
+	/* Add an initial SAVEPOINT if we just opened a transaction */
+	else if (add_savepoint)
+	{
+		elog( DEBUG1, "RSL: ProcessUtility add savepoint (slr_nest_executor_level %d, slr_nest_planner_level %d).",
+				slr_nest_executor_level, slr_nest_planner_level);
+
+		/*
+		 * save the current resowner, all caches are associated to it, it'll be
+		 * restored after the automatic SAVEPOINT will be created
+		 */
+		slr_save_resowner();
+
+		/* make sure the transaction opening has been processed */
+		CommitTransactionCommand();
+		CommandCounterIncrement();
+
+		/*
+		 * and create our savepoint. We don't check for the planner stage here,
+		 * since utilities go straight from parsing to executor without a
+		 * planner stage.
+		 */
+		slr_add_savepoint();
+
+		/* reset the flag to be extra safe */
+		add_savepoint = false;
+	}
+	else if (slr_defered_save_resowner)
+	{
+		elog(DEBUG1, "RSL: ProcessUtility release and add savepoint (slr_nest_executor_level %d, slr_nest_planner_level %d).",
+				slr_nest_executor_level, slr_nest_planner_level);
+
+		/*
+		 * save the current resowner, all caches are associated to it, it'll be
+		 * restored after the automatic SAVEPOINT will be created
+		 */
+		slr_save_resowner();
+
+		/* Release an automatic SAVEPOINT if there's one and create a new one */
+		slr_rollover_savepoint();
+
+	}
+
+	/* reset defered savepoint */
+	if (slr_defered_save_resowner)
+		SLR_TRACE(deferred__clear, SLR_TRACE_DEFERRED_CLEAR, 0);
+	slr_defered_save_resowner = false;
+
+	if (slr_nest_executor_level == 0 && !IsA(parsetree, TransactionStmt))
+		slr_current_queryid = 0;
+}
+
+/*
+ * ExecutorStart hook: release automatic savepoint if exists and create a new
+ * one.  Be careful though, the planner can spawn multiple level of executors,
+ * and we can't interfere with savepoints at that time.  We detect that we
+ * are inside the planner with the planner nest level, not with a flag set
+ * when the planner completes: cached plans run without any planner stage.
+ */
+static void
+slr_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	if (prev_ExecutorStart)
+		prev_ExecutorStart(queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
+
+#if PG_VERSION_NUM >= 90500
+	if IN_PARALLEL_WORKER
+		return;
+#endif
+
+	/*
+	 * Only handle savepoints for top level executor that's not spawned by the
+	 * planner for insert/update/delete (writer).
+	 * After a SELECT function call that have write statement inside we need to
+	 * issue a RELEASE+SAVEPOINT. In this case slr_defered_save_resowner have
+	 * been set in nested executor level call at bottom of this function.
+	 */
+	elog(DEBUG1, "RSL: ExecutorStart (slr_nest_executor_level %d, slr_nest_planner_level %d, operation %d).",
+			slr_nest_executor_level, slr_nest_planner_level, queryDesc->operation);
+
+	if (slr_enabled && slr_nest_executor_level == 0 && !SLR_IN_PLANNER())
+	{
+		/* Errors of the statement are attributed to it from now on */
+		slr_current_queryid = queryDesc->plannedstmt->queryId;
+		slr_stmt_no_autosavepoint = slr_no_autosavepoint;
+
+		elog(DEBUG1, "RSL: ExecutorStart save ResourcesOwner.");
+		/*
+		* save the resowner, all caches are associated to it, it'll be
+		* restored just after we define the SAVEPOINT
+		*/
+		slr_save_resowner();
+	}
+
+	/*
+	 * if function has write statement we must generate a
+	 * release/savepoint after the call to the function.  A plain EXPLAIN
+	 * starts the executor of the statement without running it.
+	 */
+	if (slr_enabled && slr_nest_executor_level > 0 && !SLR_IN_PLANNER() &&
+			slr_enable_writeonly && !slr_defered_save_resowner &&
+			(eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0 &&
+			slr_is_write_query(queryDesc) 
+		)
+	{
+		elog(DEBUG1, "RSL: ExecutorStart enable slr_defered_save_resowner.");
+		slr_defered_save_resowner = true;
+		SLR_TRACE(deferred__set, SLR_TRACE_DEFERRED_SET, (int) queryDesc->operation);
+	}
+}
+
+/*
+ * ExecutorRun hook: we track nesting depth, and RELEASE / SAVEPOINT for top
+ * level executor.
+ */
+static void
+slr_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+#if PG_VERSION_NUM >= 90600
+                 uint64 count
+#else
+                 long count
+#endif
+#if PG_VERSION_NUM >= 100000
+                 , bool execute_once
+#endif
+	)
+{
+	bool		retry = slr_statement_retryable(queryDesc, direction, count);
+
+	elog(DEBUG1, "RSL: ExecutorRun increasing slr_nest_executor_level.");
+	slr_nest_executor_level++;
+	SLR_TRACE(executor__enter, SLR_TRACE_EXECUTOR_ENTER, (int) queryDesc->operation);
+
+	/* On error the nest level is restored by the (sub)transaction callbacks */
+	if (retry)
+		slr_run_with_retry(queryDesc);
+	else if (prev_ExecutorRun)
+#if PG_VERSION_NUM >= 100000
+		prev_ExecutorRun(queryDesc, direction, count, execute_once);
+#else
+		prev_ExecutorRun(queryDesc, direction, count);
+#endif
+	else
+#if PG_VERSION_NUM >= 100000
+		standard_ExecutorRun(queryDesc, direction, count, execute_once);
+#else
+		standard_ExecutorRun(queryDesc, direction, count);
+#endif
+	elog(DEBUG1, "RSL: ExecutorRun decreasing slr_nest_executor_level.");
+	slr_nest_executor_level--;
+	SLR_TRACE(executor__exit, SLR_TRACE_EXECUTOR_EXIT, (int) queryDesc->operation);
+}
+
+/*
+ * ExecutorFinish hook: all we need do is track nesting depth
+ */
+static void
+slr_ExecutorFinish(QueryDesc *queryDesc)
+{
+
+	elog(DEBUG1, "RSL: ExecutorFinish increasing slr_nest_executor_level.");
+	slr_nest_executor_level++;
+	SLR_TRACE(executor__enter, SLR_TRACE_EXECUTOR_ENTER, (int) queryDesc->operation);
+
+	/* On error the nest level is restored by the (sub)transaction callbacks */
+	if (prev_ExecutorFinish)
+		prev_ExecutorFinish(queryDesc);
+	else
+		standard_ExecutorFinish(queryDesc);
+	slr_nest_executor_level--;
+	SLR_TRACE(executor__exit, SLR_TRACE_EXECUTOR_EXIT, (int) queryDesc->operation);
+	elog(DEBUG1, "RSL: ExecutorFinish decreasing slr_nest_executor_level.");
+}
+
+/* ExecutorEnd hook: for write statements, release automatic savepoint and
+ * create a new one.
+ * Be careful though, the planner can spawn multiple level of executors,
+ * and we can't interfere with savepoints at that time.  We detect that we
+ * are inside the planner with the planner nest level, not with a flag set
+ * when the planner completes: cached plans run without any planner stage.
+ */
+static void
+slr_ExecutorEnd(QueryDesc *queryDesc)
+{
+	bool		elided = true;
+
+	/*
+	 * Only handle automatic savepoints for top level executor that's not
+	 * spawned by the planner for write SQL (like slr_ExecutorStart()).
+	 */
+	elog( DEBUG1, "RSL: ExecutorEnd (slr_nest_executor_level %d, slr_nest_planner_level %d, operation %d).",
+			slr_nest_executor_level, slr_nest_planner_level, queryDesc->operation);
+
+	if (
+#if PG_VERSION_NUM >= 90500
+		!IN_PARALLEL_WORKER &&
+#endif
+		slr_enabled && slr_nest_executor_level == 0 && !SLR_IN_PLANNER() && (
+				!slr_enable_writeonly ||
+			 	slr_defered_save_resowner ||
+			 	slr_is_write_query(queryDesc) 
+			 )
+		)
+	{
+#if PG_VERSION_NUM >= 100000
+		/*
+		 * Lazy mode: the savepoint would be thrown away by the next statement
+		 * of the query string, don't renew it.
+		 */
+		if (slr_lazy_savepoint &&
+				slr_next_stmt_ends_xact(queryDesc->sourceText,
+						queryDesc->plannedstmt->stmt_location,
+						queryDesc->plannedstmt->stmt_len))
+			elog(DEBUG1, "RSL: ExecutorEnd skip automatic savepoint, next statement ends the transaction.");
+		else
+#endif
+		if (slr_statement_opted_out(slr_stmt_no_autosavepoint,
+						queryDesc->sourceText,
+#if PG_VERSION_NUM >= 100000
+						queryDesc->plannedstmt->stmt_location
+#else
+						0
+#endif
+						))
+			elog(DEBUG1, "RSL: ExecutorEnd automatic savepoint disabled for this statement.");
+		else if (slr_savepoint_unused(NULL))
+			elog(DEBUG1, "RSL: ExecutorEnd keep unused automatic savepoint.");
+#if PG_VERSION_NUM >= 100000
+		else if (slr_message_pending(queryDesc->sourceText,
+						queryDesc->plannedstmt->stmt_location,
+						queryDesc->plannedstmt->stmt_len))
+			elog(DEBUG1, "RSL: ExecutorEnd automatic savepoint deferred to the end of the message.");
+#endif
+		else if (!slr_rollover_due())
+			elog(DEBUG1, "RSL: ExecutorEnd automatic savepoint renewal not due.");
+		else
+		{
+			/* Release an automatic SAVEPOINT if there's one and create a new one */
+			slr_rollover_savepoint();
+			elided = false;
+		}
+
+		if (elided)
+		{
+			slr_stats_count(SLR_STATS_ELIDED, 0);
+			slr_backend_update();
+		}
+
+		if (slr_defered_save_resowner)
+			SLR_TRACE(deferred__clear, SLR_TRACE_DEFERRED_CLEAR, 0);
+		slr_defered_save_resowner = false;
+	}
+
+	/* The statement has completed, it will not fail anymore */
+	if (slr_nest_executor_level == 0 && !SLR_IN_PLANNER())
+		slr_current_queryid = 0;
+
+	if (prev_ExecutorEnd)
+		prev_ExecutorEnd(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+}
+
+/*
+ * This function set the current resowner to the one that has been created by
+ * DefineSavepoint(), after it has been overriden by slr_save_resowner')
+ */
+void
+slr_restore_resowner(void)
+{
+	Assert(slr_nest_executor_level == 0);
+
+	if (slr_enabled && slr_xact_opened && newresowner != NULL)
+	{
+		CurrentResourceOwner = newresowner;
+		newresowner = NULL;
+		SLR_TRACE(restore__resowner, SLR_TRACE_RESTORE_RESOWNER, 0);
+
+		elog(DEBUG1, "RSL: restoring Resource owner.");
+		slr_log("SAVEPOINT", slr_savepoint_duration);
+	}
+}
+
+/*
+ * This function save the current resowner, that'll be overriden by
+ * DefineSavepoint)
+ */
+void
+slr_save_resowner(void)
+{
+	Assert(oldresowner == NULL);
+	Assert(slr_nest_executor_level == 0);
+
+	if (slr_enabled && slr_xact_opened)
+	{
+		oldresowner = CurrentResourceOwner;
+		SLR_TRACE(save__resowner, SLR_TRACE_SAVE_RESOWNER, 0);
+		elog(DEBUG1, "RSL: Saving the Resource owner.");
+		slrPortalContext = PortalContext;
+	}
+}
+
+/*
+ * This function create a new savepoint.  However, adding a SAVEPOINT will
+ * create a new resowner, and we can't let the new resowner at this point,
+ * because following query execution will have to clear all entries associated
+ * to the former resowner.  Therefore, we backup the new resowner, which will
+ * be restored after the cleanup is done.  There's no hook available to do
+ * that, so we rely on the current query context (PortalContext) cleanup
+ * callback to do this.
+ */
+void
+slr_add_savepoint(void)
+{
+	Assert(slr_nest_executor_level == 0);
+
+	if (slr_enabled && slr_xact_opened)
+	{
+		instr_time	start;
+
+		elog(DEBUG1, "RSL: adding savepoint %s.", slr_savepoint_name);
+
+		INSTR_TIME_SET_CURRENT(start);
+
+		/* Define savepoint */
+		DefineSavepoint(slr_savepoint_name);
+		elog(DEBUG1, "RSL: CommitTransactionCommand.");
+		CommitTransactionCommand();
+		elog(DEBUG1, "RSL: CommandCounterIncrement.");
+		CommandCounterIncrement();
+
+		slr_savepoint_duration = slr_elapsed_ms(start);
+
+		slr_attach_savepoint();
+	}
+}
+
+/*
+ * Release the current automatic savepoint and create a new one in a single
+ * step.  When the automatic savepoint is the current subtransaction it is
+ * released directly, without searching the transaction stack for its name,
+ * and the new one is started as an internal subtransaction, with a single
+ * CommandCounterIncrement for the whole cycle.  Otherwise, for example when
+ * the client has rolled back to one of its own savepoints, fall back to the
+ * RELEASE/SAVEPOINT by name.
+ */
+void
+slr_rollover_savepoint(void)
+{
+	MemoryContext oldcontext;
+	instr_time	start;
+	double		duration;
+
+	Assert(slr_nest_executor_level == 0);
+
+	if (!slr_enabled || !slr_xact_opened)
+		return;
+
+	if (slr_shared != NULL)
+	{
+		slr_xact_rollovers++;
+		slr_xact_last_rollover = GetCurrentTimestamp();
+	}
+
+	/* The time spent in logging is not part of the rollover */
+	slr_release_duration = 0;
+	slr_savepoint_duration = 0;
+
+	if (!slr_pending ||
+			slr_savepoint_nestlevel != GetCurrentTransactionNestLevel())
+	{
+		slr_release_savepoint();
+		slr_add_savepoint();
+	}
+	else
+	{
+		elog(DEBUG1, "RSL: rolling over savepoint %s.", slr_savepoint_name);
+
+		/*
+		 * ReleaseCurrentSubTransaction() leaves us in the parent's context,
+		 * go back to the caller's one unless it belongs to the released
+		 * savepoint.
+		 */
+		INSTR_TIME_SET_CURRENT(start);
+		oldcontext = CurrentMemoryContext;
+		if (oldcontext == CurTransactionContext)
+			oldcontext = NULL;
+		ReleaseCurrentSubTransaction();
+		if (oldcontext != NULL)
+			MemoryContextSwitchTo(oldcontext);
+		slr_pending = false;
+		slr_release_duration = slr_elapsed_ms(start);
+		SLR_TRACE(release__savepoint, SLR_TRACE_RELEASE_SAVEPOINT, slr_savepoint_nestlevel);
+
+		/* Manually log the order if needed */
+		slr_log("RELEASE", slr_release_duration);
+
+		INSTR_TIME_SET_CURRENT(start);
+		BeginInternalSubTransaction(slr_savepoint_name);
+		CommandCounterIncrement();
+		slr_savepoint_duration = slr_elapsed_ms(start);
+
+		slr_attach_savepoint();
+	}
+
+	duration = slr_release_duration + slr_savepoint_duration;
+	slr_latency_count(duration);
+	slr_stats_count(SLR_STATS_ROLLOVER, duration);
+}
+
+/*
+ * Release the automatic savepoint before a client savepoint is defined, when
+ * it is the current subtransaction.  We are running the client's statement,
+ * stay in its memory context and resource owner.
+ */
+static void
+slr_release_before_client_savepoint(void)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	ResourceOwner oldowner = CurrentResourceOwner;
+	instr_time	start;
+
+	if (!slr_xact_opened || !slr_pending || slr_nest_executor_level != 0 ||
+			slr_savepoint_nestlevel != GetCurrentTransactionNestLevel())
+		return;
+
+	elog(DEBUG1, "RSL: releasing savepoint %s before client savepoint.",
+			slr_savepoint_name);
+
+	INSTR_TIME_SET_CURRENT(start);
+	if (oldcontext == CurTransactionContext)
+		oldcontext = NULL;
+	ReleaseCurrentSubTransaction();
+	if (oldcontext != NULL)
+		MemoryContextSwitchTo(oldcontext);
+	CurrentResourceOwner = oldowner;
+	CommandCounterIncrement();
+	slr_pending = false;
+	SLR_TRACE(release__savepoint, SLR_TRACE_RELEASE_SAVEPOINT, slr_savepoint_nestlevel);
+	slr_backend_update();
+
+	/* Manually log the order if needed */
+	slr_log("RELEASE", slr_elapsed_ms(start));
+}
+
+/*
+ * Stash the resowner of the automatic savepoint that has just been created,
+ * see slr_add_savepoint().
+ */
+static void
+slr_attach_savepoint(void)
+{
+	MemoryContextCallback *slr_cb = NULL;
+
+	/*
+	 * Backup the new resowner, will be restore the end of execution on the
+	 * Portal memory context callback
+	 */
+	newresowner = CurrentResourceOwner;
+
+	/* And restore the one we previously saved */
+	if (oldresowner == NULL)
+		elog(ERROR, "Automatic savepoint internal error, no resource owner.");
+	if (slrPortalContext == NULL)
+		elog(ERROR, "Automatic savepoint internal error, no portal context.");
+
+	CurrentResourceOwner = oldresowner;
+	oldresowner = NULL;
+
+	/*
+	 * Add the callback that will restore the new resowner when the cleanup
+	 * will be finished
+	 */
+	slr_cb = MemoryContextAlloc(slrPortalContext, sizeof(MemoryContextCallback));
+	slr_cb->arg = NULL;
+	slr_cb->func = (void *) slr_restore_resowner;
+	elog(DEBUG1, "RSL: add the callback that will restore the new resowner when the cleanup.");
+	MemoryContextRegisterResetCallback(slrPortalContext, slr_cb);
+	slrPortalContext = NULL;
+
+	slr_savepoint_nestlevel = GetCurrentTransactionNestLevel();
+	slr_stmt_count = 0;
+	if (slr_rollover_interval > 0)
+		slr_last_rollover = GetCurrentTimestamp();
+	slr_pending = true;
+	SLR_TRACE(add__savepoint, SLR_TRACE_ADD_SAVEPOINT, slr_savepoint_nestlevel);
+	slr_stats_count(SLR_STATS_CREATED, 0);
+	slr_backend_update();
+}
+
+/*
+ * Automatic retry: a top level write statement executed in a transaction
+ * with an automatic savepoint can be executed again when it fails on a lock.
+ * It must not have sent rows to the client, so statements with a RETURNING
+ * clause are excluded, and must run to completion.  Writable CTEs are
+ * excluded too as they are run to completion by ExecutorFinish.
+ */
+static bool
+slr_statement_retryable(QueryDesc *queryDesc, ScanDirection direction,
+						uint64 count)
+{
+	return slr_enabled && slr_auto_retry > 0 && !IN_PARALLEL_WORKER &&
+		slr_nest_executor_level == 0 && !SLR_IN_PLANNER() &&
+		slr_xact_opened && slr_pending &&
+		slr_savepoint_nestlevel == GetCurrentTransactionNestLevel() &&
+		queryDesc->operation != CMD_SELECT &&
+		queryDesc->operation != CMD_UTILITY &&
+		!queryDesc->plannedstmt->hasReturning &&
+		!queryDesc->plannedstmt->hasModifyingCTE &&
+		ScanDirectionIsForward(direction) && count == 0;
+}
+
+/*
+ * The executor state of the statement belongs to the automatic savepoint,
+ * rolling it back would also destroy the portal.  Instead each attempt runs
+ * a new executor for the same plan in an internal subtransaction, like a
+ * PL/pgSQL exception block, and the executor of the statement is left
+ * unused.  Only the number of processed rows is reported to it.
+ */
+static void
+slr_run_with_retry(QueryDesc *queryDesc)
+{
+	volatile int attempt = 0;
+	volatile bool done = false;
+
+	while (!done)
+	{
+		MemoryContext oldcontext = CurrentMemoryContext;
+		ResourceOwner oldowner = CurrentResourceOwner;
+
+		BeginInternalSubTransaction(NULL);
+		MemoryContextSwitchTo(oldcontext);
+
+		PG_TRY();
+		{
+			slr_run_statement_copy(queryDesc, attempt > 0);
+
+			ReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(oldcontext);
+			CurrentResourceOwner = oldowner;
+
+			if (attempt > 0)
+				slr_retries_recovered++;
+			done = true;
+		}
+		PG_CATCH();
+		{
+			ErrorData  *edata;
+
+			MemoryContextSwitchTo(oldcontext);
+			edata = CopyErrorData();
+			FlushErrorState();
+
+			RollbackAndReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(oldcontext);
+			CurrentResourceOwner = oldowner;
+
+			if (!slr_error_retryable(edata))
+				ReThrowError(edata);
+
+			if (attempt >= slr_auto_retry)
+			{
+				slr_retries_exhausted++;
+				ReThrowError(edata);
+			}
+
+			attempt++;
+			slr_retries++;
+			ereport(LOG,
+					(errmsg("automatic retry %d of statement after error: %s",
+							attempt, edata->message)));
+			FreeErrorData(edata);
+
+			if (slr_auto_retry_delay > 0)
+				slr_retry_wait((long) slr_auto_retry_delay * attempt);
+			CHECK_FOR_INTERRUPTS();
+		}
+		PG_END_TRY();
+	}
+}
+
+/*
+ * Execute the plan of the statement with a new executor.  A retry takes a
+ * new snapshot so that, in READ COMMITTED, it sees the changes of the
+ * transactions it has been waiting for.  The executor hooks installed before
+ * this module see each attempt as a complete execution, the ones installed
+ * after it only see the statement.
+ */
+static void
+slr_run_statement_copy(QueryDesc *queryDesc, bool new_snapshot)
+{
+	QueryDesc  *qd;
+	Snapshot	snapshot;
+
+	snapshot = new_snapshot ? GetTransactionSnapshot() : queryDesc->snapshot;
+	PushActiveSnapshot(snapshot);
+
+	qd = CreateQueryDesc(queryDesc->plannedstmt, queryDesc->sourceText,
+						 GetActiveSnapshot(), queryDesc->crosscheck_snapshot,
+						 queryDesc->dest, queryDesc->params,
+#if PG_VERSION_NUM >= 100000
+						 queryDesc->queryEnv,
+#endif
+						 0);
+
+	if (prev_ExecutorStart)
+		prev_ExecutorStart(qd, queryDesc->estate->es_top_eflags);
+	else
+		standard_ExecutorStart(qd, queryDesc->estate->es_top_eflags);
+
+	if (prev_ExecutorRun)
+#if PG_VERSION_NUM >= 100000
+		prev_ExecutorRun(qd, ForwardScanDirection, 0, true);
+#else
+		prev_ExecutorRun(qd, ForwardScanDirection, 0);
+#endif
+	else
+#if PG_VERSION_NUM >= 100000
+		standard_ExecutorRun(qd, ForwardScanDirection, 0, true);
+#else
+		standard_ExecutorRun(qd, ForwardScanDirection, 0);
+#endif
+
+	if (prev_ExecutorFinish)
+		prev_ExecutorFinish(qd);
+	else
+		standard_ExecutorFinish(qd);
+
+	queryDesc->estate->es_processed = qd->estate->es_processed;
+#if PG_VERSION_NUM < 120000
+	queryDesc->estate->es_lastoid = qd->estate->es_lastoid;
+#endif
+
+	if (prev_ExecutorEnd)
+		prev_ExecutorEnd(qd);
+	else
+		standard_ExecutorEnd(qd);
+	FreeQueryDesc(qd);
+
+	PopActiveSnapshot();
+}
+
+/*
+ * Wait before an automatic retry.  Unlike pg_usleep() the wait ends on a
+ * cancel request or a termination of the backend, and with the postmaster.
+ */
+static void
+slr_retry_wait(long delay_ms)
+{
+	TimestampTz end = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+												  delay_ms);
+
+	for (;;)
+	{
+		long		secs;
+		int			usecs;
+		long		remaining;
+#if PG_VERSION_NUM < 120000
+		int			rc;
+#endif
+
+		CHECK_FOR_INTERRUPTS();
+
+		TimestampDifference(GetCurrentTimestamp(), end, &secs, &usecs);
+		remaining = secs * 1000L + usecs / 1000;
+		if (remaining <= 0)
+			break;
+
+#if PG_VERSION_NUM >= 120000
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 remaining, PG_WAIT_EXTENSION);
+#else
+		rc = WaitLatch(MyLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   remaining
+#if PG_VERSION_NUM >= 100000
+					   , PG_WAIT_EXTENSION
+#endif
+					   );
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+#endif
+		ResetLatch(MyLatch);
+	}
+}
+
+/*
+ * Deadlocks and lock timeouts are worth a retry.  A serialization failure is
+ * only retried in READ COMMITTED, at higher isolation levels the retry would
+ * use the same transaction snapshot and fail again.
+ */
+static bool
+slr_error_retryable(ErrorData *edata)
+{
+	switch (edata->sqlerrcode)
+	{
+		case ERRCODE_T_R_DEADLOCK_DETECTED:
+		case ERRCODE_LOCK_NOT_AVAILABLE:
+			return true;
+		case ERRCODE_T_R_SERIALIZATION_FAILURE:
+			return !IsolationUsesXactSnapshot();
+		default:
+			return false;
+	}
+}
+
+/*
+ * SQL function returning the automatic retry counters of the backend.
+ */
+Datum
+pg_statement_rollback_retries(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[3];
+	bool		nulls[3];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum(slr_retries);
+	values[1] = Int64GetDatum(slr_retries_recovered);
+	values[2] = Int64GetDatum(slr_retries_exhausted);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * A subtransaction is released: what was kept below its transaction context
+ * is now kept below its parent's one.  When this is the automatic savepoint,
+ * its own context is kept too unless it is empty.  Called from the
+ * subtransaction callback, before the context is deleted or reparented.
+ */
+static void
+slr_account_released_level(int nestlevel)
+{
+	slrNestLevels *level = &slr_subxact_levels[nestlevel];
+	slrNestLevels *parent = &slr_subxact_levels[nestlevel - 1];
+
+	if (slr_pending && nestlevel == slr_savepoint_nestlevel)
+	{
+		slr_released_savepoints++;
+		slr_stats_count(SLR_STATS_RELEASED, 0);
+		if (!MemoryContextIsEmpty(CurTransactionContext))
+		{
+			int64	bytes = SLR_CONTEXT_BYTES(CurTransactionContext);
+
+			level->retained_contexts++;
+			level->retained_bytes += bytes;
+			slr_retained_contexts++;
+			slr_retained_bytes += bytes;
+		}
+	}
+
+	parent->retained_contexts += level->retained_contexts;
+	parent->retained_bytes += level->retained_bytes;
+	level->retained_contexts = 0;
+	level->retained_bytes = 0;
+}
+
+/*
+ * Bounded mode: once the memory retained by the automatic savepoints of the
+ * transaction reaches pg_statement_rollback.max_retained_memory, the current
+ * automatic savepoint is kept for the following statements.  The rollover
+ * resumes if a rollback to a client savepoint frees some of this memory.
+ */
+static bool
+slr_retained_memory_exceeded(void)
+{
+	if (slr_max_retained_memory <= 0 ||
+			slr_retained_bytes < (int64) slr_max_retained_memory * 1024)
+		return false;
+
+	if (!slr_retained_warned)
+	{
+		ereport(WARNING,
+				(errmsg("automatic savepoint is no longer renewed"),
+				 errdetail("The memory retained by the released automatic savepoints exceeds pg_statement_rollback.max_retained_memory."),
+				 errhint("On error the transaction will roll back to the last automatic savepoint.")));
+		slr_retained_warned = true;
+	}
+
+	return true;
+}
+
+/*
+ * SQL function returning the memory retained by the automatic savepoints of
+ * the current transaction.  The total of the transaction is only available
+ * with PostgreSQL 13 and later.
+ */
+Datum
+pg_statement_rollback_memory(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[4];
+	bool		nulls[4];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum(slr_released_savepoints);
+	values[1] = Int64GetDatum(slr_retained_contexts);
+	values[2] = Int64GetDatum(slr_retained_bytes);
+#if PG_VERSION_NUM >= 130000
+	values[3] = Int64GetDatum((int64) MemoryContextMemAllocated(TopTransactionContext, true));
+#else
+	nulls[3] = true;
+#endif
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Shared memory needed by the statistics
+ */
+static Size
+slr_stats_memsize(void)
+{
+	Size		size;
+
+	size = MAXALIGN(sizeof(slrSharedState));
+	size = add_size(size, hash_estimate_size(slr_stats_max,
+											 sizeof(slrStatsEntry)));
+	size = add_size(size, hash_estimate_size(slr_stats_max_queries,
+											 sizeof(slrQueryStatsEntry)));
+	size = add_size(size, mul_size(slr_max_backends(),
+								   sizeof(slrBackendState)));
+
+	return size;
+}
+
+/*
+ * Reserve the shared memory and the lock of the statistics, from the
+ * shmem_request_hook since PostgreSQL 15 and from _PG_init() before.
+ */
+static void
+slr_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(slr_stats_memsize());
+#if PG_VERSION_NUM >= 90600
+	RequestNamedLWLockTranche("pg_statement_rollback", 1);
+#else
+	RequestAddinLWLocks(1);
+#endif
+}
+
+/*
+ * Create or attach to the shared memory of the statistics
+ */
+static void
+slr_shmem_startup(void)
+{
+	bool		found;
+	HASHCTL		info;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	slr_shared = NULL;
+	slr_stats_hash = NULL;
+	slr_query_stats_hash = NULL;
+	slr_backends = NULL;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	slr_shared = ShmemInitStruct("pg_statement_rollback",
+								 sizeof(slrSharedState), &found);
+	if (!found)
+	{
+#if PG_VERSION_NUM >= 90600
+		slr_shared->lock = &(GetNamedLWLockTranche("pg_statement_rollback"))->lock;
+#else
+		slr_shared->lock = LWLockAssign();
+#endif
+		slr_shared->stats_reset = GetCurrentTimestamp();
+		slr_shared->max_backends = slr_max_backends();
+	}
+
+	slr_backends = ShmemInitStruct("pg_statement_rollback backends",
+								   mul_size(slr_shared->max_backends,
+											sizeof(slrBackendState)),
+								   &found);
+	if (!found)
+		memset(slr_backends, 0,
+			   mul_size(slr_shared->max_backends, sizeof(slrBackendState)));
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(slrStatsKey);
+	info.entrysize = sizeof(slrStatsEntry);
+	slr_stats_hash = ShmemInitHash("pg_statement_rollback hash",
+								   slr_stats_max, slr_stats_max,
+								   &info, HASH_ELEM | HASH_BLOBS);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(slrQueryStatsKey);
+	info.entrysize = sizeof(slrQueryStatsEntry);
+	slr_query_stats_hash = ShmemInitHash("pg_statement_rollback query hash",
+										 slr_stats_max_queries,
+										 slr_stats_max_queries,
+										 &info, HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Add an event to the statistics of the current database and role.  The
+ * entry is created on first use, nothing is counted once the hash table is
+ * full.
+ */
+static void
+slr_stats_count(int kind, double time)
+{
+	slrStatsKey key;
+	slrStatsEntry *entry;
+
+	if (slr_shared == NULL || slr_stats_hash == NULL)
+		return;
+
+	memset(&key, 0, sizeof(key));
+	key.dbid = MyDatabaseId;
+	key.userid = GetUserId();
+
+	if (slr_stats_entry == NULL ||
+			memcmp(&key, &slr_stats_entry_key, sizeof(key)) != 0)
+	{
+		bool		found;
+
+		LWLockAcquire(slr_shared->lock, LW_SHARED);
+		entry = (slrStatsEntry *) hash_search(slr_stats_hash, &key,
+											  HASH_FIND, NULL);
+		LWLockRelease(slr_shared->lock);
+
+		if (entry == NULL)
+		{
+			LWLockAcquire(slr_shared->lock, LW_EXCLUSIVE);
+			entry = (slrStatsEntry *) hash_search(slr_stats_hash, &key,
+												  HASH_ENTER_NULL, &found);
+			if (entry != NULL && !found)
+			{
+				memset(&entry->counters, 0, sizeof(slrStatsCounters));
+				SpinLockInit(&entry->mutex);
+			}
+			LWLockRelease(slr_shared->lock);
+
+			if (entry == NULL)
+				return;
+		}
+
+		slr_stats_entry = entry;
+		slr_stats_entry_key = key;
+	}
+
+	entry = slr_stats_entry;
+	SpinLockAcquire(&entry->mutex);
+	switch (kind)
+	{
+		case SLR_STATS_CREATED:
+			entry->counters.created++;
+			break;
+		case SLR_STATS_RELEASED:
+			entry->counters.released++;
+			break;
+		case SLR_STATS_ROLLED_BACK:
+			entry->counters.rolled_back++;
+			break;
+		case SLR_STATS_ROLLOVER:
+			entry->counters.rollovers++;
+			entry->counters.rollover_time += time;
+			break;
+		case SLR_STATS_ELIDED:
+			entry->counters.elided++;
+			break;
+	}
+	SpinLockRelease(&entry->mutex);
+
+	if (kind == SLR_STATS_ROLLOVER || kind == SLR_STATS_ROLLED_BACK)
+		slr_query_stats_count(kind, time);
+}
+
+/*
+ * Add a rollover or a rollback to the statistics of the current statement.
+ * Nothing is counted without a queryId, pg_stat_statements or
+ * compute_query_id must be enabled.  The counters are kept in the backend
+ * until the end of the transaction, a rollover does not take the lock of the
+ * shared hash table.
+ */
+static void
+slr_query_stats_count(int kind, double time)
+{
+	slrQueryStatsKey key;
+	slrQueryStatsPending *pending = NULL;
+	int			i;
+
+	if (slr_current_queryid == 0 || slr_query_stats_hash == NULL)
+		return;
+
+	memset(&key, 0, sizeof(key));
+	key.dbid = MyDatabaseId;
+	key.userid = GetUserId();
+	key.queryid = slr_current_queryid;
+
+	for (i = 0; i < slr_query_stats_npending; i++)
+	{
+		if (memcmp(&key, &slr_query_stats_pending[i].key, sizeof(key)) == 0)
+		{
+			pending = &slr_query_stats_pending[i];
+			break;
+		}
+	}
+
+	if (pending == NULL)
+	{
+		if (slr_query_stats_npending == SLR_QUERY_STATS_PENDING)
+			slr_query_stats_flush();
+
+		pending = &slr_query_stats_pending[slr_query_stats_npending++];
+		memset(pending, 0, sizeof(slrQueryStatsPending));
+		pending->key = key;
+	}
+
+	if (kind == SLR_STATS_ROLLOVER)
+	{
+		pending->rollovers++;
+		pending->total_time += time;
+		if (time > pending->max_time)
+			pending->max_time = time;
+	}
+	else
+		pending->rolled_back++;
+}
+
+/*
+ * Add the statement counters kept by the backend to the shared hash table.
+ * The entries are created under the exclusive lock only when they are
+ * missing, nothing is counted once the hash table is full.
+ */
+static void
+slr_query_stats_flush(void)
+{
+	slrQueryStatsEntry *entry;
+	bool		missing = false;
+	bool		found;
+	int			i;
+
+	if (slr_query_stats_npending == 0 || slr_query_stats_hash == NULL)
+		return;
+
+	LWLockAcquire(slr_shared->lock, LW_SHARED);
+	for (i = 0; i < slr_query_stats_npending; i++)
+	{
+		slrQueryStatsPending *pending = &slr_query_stats_pending[i];
+
+		entry = (slrQueryStatsEntry *) hash_search(slr_query_stats_hash,
+												   &pending->key,
+												   HASH_FIND, NULL);
+		if (entry == NULL)
+		{
+			missing = true;
+			continue;
+		}
+
+		/* The entry can not be removed while we hold the lock */
+		slr_query_stats_add(entry, pending);
+		pending->key.queryid = 0;
+	}
+	LWLockRelease(slr_shared->lock);
+
+	if (missing)
+	{
+		LWLockAcquire(slr_shared->lock, LW_EXCLUSIVE);
+		for (i = 0; i < slr_query_stats_npending; i++)
+		{
+			slrQueryStatsPending *pending = &slr_query_stats_pending[i];
+
+			/* Already added */
+			if (pending->key.queryid == 0)
+				continue;
+
+			entry = (slrQueryStatsEntry *) hash_search(slr_query_stats_hash,
+													   &pending->key,
+													   HASH_ENTER_NULL,
+													   &found);
+			if (entry == NULL)
+				continue;
+			if (!found)
+			{
+				entry->rollovers = 0;
+				entry->total_time = 0;
+				entry->max_time = 0;
+				entry->rolled_back = 0;
+				SpinLockInit(&entry->mutex);
+			}
+			slr_query_stats_add(entry, pending);
+		}
+		LWLockRelease(slr_shared->lock);
+	}
+
+	slr_query_stats_npending = 0;
+}
+
+static void
+slr_query_stats_add(slrQueryStatsEntry *entry, slrQueryStatsPending *pending)
+{
+	SpinLockAcquire(&entry->mutex);
+	entry->rollovers += pending->rollovers;
+	entry->total_time += pending->total_time;
+	if (pending->max_time > entry->max_time)
+		entry->max_time = pending->max_time;
+	entry->rolled_back += pending->rolled_back;
+	SpinLockRelease(&entry->mutex);
+}
+
+static void
+slr_stats_check(void)
+{
+	if (slr_shared == NULL || slr_stats_hash == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_statement_rollback must be loaded via shared_preload_libraries")));
+}
+
+/*
+ * SQL function returning the statistics of all databases and roles
+ */
+Datum
+pg_statement_rollback_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS hash_seq;
+	slrStatsEntry *entry;
+	TimestampTz stats_reset;
+
+	slr_stats_check();
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(slr_shared->lock, LW_SHARED);
+
+	stats_reset = slr_shared->stats_reset;
+
+	hash_seq_init(&hash_seq, slr_stats_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[SLR_STATS_COLS];
+		bool		nulls[SLR_STATS_COLS];
+		slrStatsCounters counters;
+
+		SpinLockAcquire(&entry->mutex);
+		counters = entry->counters;
+		SpinLockRelease(&entry->mutex);
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = ObjectIdGetDatum(entry->key.userid);
+		values[1] = ObjectIdGetDatum(entry->key.dbid);
+		values[2] = Int64GetDatum(counters.created);
+		values[3] = Int64GetDatum(counters.released);
+		values[4] = Int64GetDatum(counters.rolled_back);
+		values[5] = Int64GetDatum(counters.rollovers);
+		values[6] = Int64GetDatum(counters.elided);
+		values[7] = Float8GetDatum(counters.rollover_time);
+		values[8] = TimestampTzGetDatum(stats_reset);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(slr_shared->lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * SQL function returning the statistics of the statements
+ */
+Datum
+pg_statement_rollback_query_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS hash_seq;
+	slrQueryStatsEntry *entry;
+
+	slr_stats_check();
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(slr_shared->lock, LW_SHARED);
+
+	hash_seq_init(&hash_seq, slr_query_stats_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[SLR_QUERY_STATS_COLS];
+		bool		nulls[SLR_QUERY_STATS_COLS];
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = ObjectIdGetDatum(entry->key.userid);
+		values[1] = ObjectIdGetDatum(entry->key.dbid);
+		values[2] = Int64GetDatum((int64) entry->key.queryid);
+
+		SpinLockAcquire(&entry->mutex);
+		values[3] = Int64GetDatum(entry->rollovers);
+		values[4] = Float8GetDatum(entry->total_time);
+		values[5] = Float8GetDatum(entry->max_time);
+		values[6] = Int64GetDatum(entry->rolled_back);
+		SpinLockRelease(&entry->mutex);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	LWLockRelease(slr_shared->lock);
+
+	return (Datum) 0;
+}
+
+/*
+ * Number of backend slots.  Before PostgreSQL 15, MaxBackends is not
+ * computed yet when the shared memory is requested, do the same sum.
+ */
+static int
+slr_max_backends(void)
+{
+#if PG_VERSION_NUM >= 150000
+	return MaxBackends;
+#else
+	return MaxConnections + autovacuum_max_workers + 1 +
+		max_worker_processes
+#if PG_VERSION_NUM >= 120000
+		+ max_wal_senders
+#endif
+		;
+#endif
+}
+
+/*
+ * Publish the automatic savepoint state of the backend in its slot, the slot
+ * is claimed on first use.  Only plain stores, this is called on each
+ * rollover and at each subtransaction boundary.
+ */
+static void
+slr_backend_update(void)
+{
+	slrBackendState *slot = slr_my_backend;
+	bool		publish = false;
+
+	if (slot == NULL)
+	{
+		int			index;
+
+		if (slr_backends == NULL)
+			return;
+#if PG_VERSION_NUM >= 170000
+		index = MyProcNumber;
+#else
+		index = MyBackendId - 1;
+#endif
+		if (index < 0 || index >= slr_shared->max_backends)
+			return;
+
+		slot = &slr_backends[index];
+		memset(slot, 0, sizeof(slrBackendState));
+		slot->dbid = MyDatabaseId;
+		on_shmem_exit(slr_backend_detach, (Datum) 0);
+		slr_my_backend = slot;
+		publish = true;
+	}
+
+	slr_count_subxid();
+
+	slot->depth = slr_xact_opened ? GetCurrentTransactionNestLevel() - 1 : 0;
+	slot->pending = slr_pending;
+	slot->subxids = slr_xact_subxids;
+	slot->rollovers = slr_xact_rollovers;
+	slot->last_rollover = slr_xact_last_rollover;
+
+	/* The slot is only read once the pid is set, after the other fields */
+	if (publish)
+	{
+		pg_write_barrier();
+		slot->pid = MyProcPid;
+	}
+}
+
+/*
+ * Count the xid of the current subtransaction once it has been assigned.  It
+ * is checked when the subtransaction ends and each time the slot of the
+ * backend is updated, so that the subtransactions still open show up.
+ */
+static void
+slr_count_subxid(void)
+{
+	int			nestlevel = GetCurrentTransactionNestLevel();
+
+	if (nestlevel > 1 && nestlevel < slr_subxact_levels_size &&
+			!slr_subxact_levels[nestlevel].xid_counted &&
+			TransactionIdIsValid(GetCurrentTransactionIdIfAny()))
+	{
+		slr_subxact_levels[nestlevel].xid_counted = true;
+		slr_xact_subxids++;
+	}
+}
+
+/*
+ * Release the slot of the backend when it exits, the pid is cleared before
+ * the slot can be claimed again.
+ */
+static void
+slr_backend_detach(int code, Datum arg)
+{
+	if (slr_my_backend != NULL)
+	{
+		slr_my_backend->pid = 0;
+		pg_write_barrier();
+	}
+	slr_my_backend = NULL;
+}
+
+/*
+ * SQL function returning the automatic savepoint state of the backends,
+ * to be joined to pg_stat_activity by pid.
+ */
+Datum
+pg_statement_rollback_backends(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	int			i;
+
+	slr_stats_check();
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	for (i = 0; i < slr_shared->max_backends; i++)
+	{
+		Datum		values[SLR_BACKENDS_COLS];
+		bool		nulls[SLR_BACKENDS_COLS];
+		slrBackendState slot;
+
+		/* Read the other fields after the pid, see slr_backend_update() */
+		if (slr_backends[i].pid == 0)
+			continue;
+		pg_read_barrier();
+		memcpy(&slot, &slr_backends[i], sizeof(slrBackendState));
+		if (slot.pid == 0)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = Int32GetDatum(slot.pid);
+		values[1] = ObjectIdGetDatum(slot.dbid);
+		values[2] = Int32GetDatum(slot.depth);
+		values[3] = BoolGetDatum(slot.pending);
+		values[4] = Int32GetDatum(slot.subxids);
+		values[5] = Int64GetDatum(slot.rollovers);
+		if (slot.last_rollover == 0)
+			nulls[6] = true;
+		else
+			values[6] = TimestampTzGetDatum(slot.last_rollover);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * SQL function clearing the statistics of all databases and roles
+ */
+Datum
+pg_statement_rollback_stats_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	slrStatsEntry *entry;
+	slrQueryStatsEntry *qentry;
+
+	slr_stats_check();
+
+	LWLockAcquire(slr_shared->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&hash_seq, slr_stats_hash);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		SpinLockAcquire(&entry->mutex);
+		memset(&entry->counters, 0, sizeof(slrStatsCounters));
+		SpinLockRelease(&entry->mutex);
+	}
 
-				/* mark the transaction as opened in all cases */
-				elog(DEBUG1, "RSL: mark the transaction as opened with BEGIN/START.");
-				slr_xact_opened = true;
-				break;
-			case TRANS_STMT_COMMIT:
-			case TRANS_STMT_COMMIT_PREPARED:
-			case TRANS_STMT_ROLLBACK_PREPARED:
-			case TRANS_STMT_ROLLBACK:
-				elog(DEBUG1, "RSL: mark the transaction as closed with ROLLBACK.");
-				slr_xact_opened = false;
-				/* any existing SAVEPOINT will automatically be released */
-				slr_pending = false;
-				break;
-			case TRANS_STMT_SAVEPOINT:
-				/* At this point, previous command (either DML or utility) will
-				* have opened a SAVEPOINT (if a transaction is opened,
-				* otherwise client's SAVEPOINT order will fail anyway).
-				*
-				* So if client send a SAVEPOINT order, next
-				* slr_release_savepoint will release both our savepoint and
-				* the client's one, since the client's one will be contained
-				* in our own.  We could release our own now, but if the
-				* command fails for any reason, the transaction will be
-				* irrevocably dead.
-				*
-				* So our only option is to force adding our own savepoint
-				* a second time after user's one if it succeed, but without
-				* releasing it before.  This will
-				* keep client's savepoint alive and still being able to do our
-				* statement rollback.  Unfortunately, it means that we'll have
-				* to pile up as many automatic savepoints as the client runs
-				* SAVEPOINT commands in its transaction.
-				*
-				* We will not issue the SAVEPOINT if the client is using the
-				* same SAVEPOINT name as our automatic SAVEPOINT/
-				*/
-#if PG_VERSION_NUM >= 110000
-				name = pstrdup(stmt->savepoint_name);
+	/* Nobody keeps a pointer to the statement entries, remove them */
+	hash_seq_init(&hash_seq, slr_query_stats_hash);
+	while ((qentry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(slr_query_stats_hash, &qentry->key, HASH_REMOVE, NULL);
+
+	slr_shared->stats_reset = GetCurrentTimestamp();
+
+	LWLockRelease(slr_shared->lock);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * This function release an automatic SAVEPOINT that
+ * has previously been created
+ */
+void
+slr_release_savepoint(void)
+{
+	Assert(slr_nest_executor_level == 0);
+
+	if (slr_enabled && slr_xact_opened && slr_pending)
+	{
+		instr_time	start;
+#if PG_VERSION_NUM < 110000
+		List       *options = NIL;
+		DefElem    *elem = NULL;
+
+		elog(DEBUG1, "RSL: releasing savepoint %s.", slr_savepoint_name);
+
+		elem = makeDefElem("savepoint_name",
+				(Node *) makeString(slr_savepoint_name)
+#if PG_VERSION_NUM >= 100000
+				, -1
+#endif
+				);
+
+		options = list_make1(elem);
+
+		INSTR_TIME_SET_CURRENT(start);
+		ReleaseSavepoint(options);
 #else
-				foreach(cell, stmt->options)
-				{
-					DefElem    *elem = lfirst(cell);
+		INSTR_TIME_SET_CURRENT(start);
+		ReleaseSavepoint(slr_savepoint_name);
+#endif
+		CommitTransactionCommand();
+		CommandCounterIncrement();
+		slr_release_duration = slr_elapsed_ms(start);
 
-					if (strcmp(elem->defname, "savepoint_name") == 0)
-						name = strVal(elem->arg);
-				}
+		slr_pending = false;
+		SLR_TRACE(release__savepoint, SLR_TRACE_RELEASE_SAVEPOINT, slr_savepoint_nestlevel);
+		slr_backend_update();
+
+		/* Manually log the order if needed */
+		slr_log("RELEASE", slr_release_duration);
+	}
+}
+
+/*
+ * Milliseconds elapsed since start
+ */
+static double
+slr_elapsed_ms(instr_time start)
+{
+	instr_time	duration;
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	return INSTR_TIME_GET_MILLISEC(duration);
+}
+
+/*
+ * Add a rollover to the latency histogram of the backend
+ */
+static void
+slr_latency_count(double msec)
+{
+	double		usec = msec * 1000.0;
+	int			bucket = 0;
+
+	while (bucket < SLR_LATENCY_BUCKETS - 1 && usec >= (double) (1 << bucket))
+		bucket++;
+
+	slr_latency_histogram[bucket]++;
+}
+
+/*
+ * SQL function returning the latency histogram of the rollovers of the
+ * backend, one row per bucket, bounds in microseconds.
+ */
+Datum
+pg_statement_rollback_latency(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	int			i;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	for (i = 0; i < SLR_LATENCY_BUCKETS; i++)
+	{
+		Datum		values[3];
+		bool		nulls[3];
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = Int64GetDatum(i == 0 ? 0 : (int64) 1 << (i - 1));
+		if (i == SLR_LATENCY_BUCKETS - 1)
+			nulls[1] = true;
+		else
+			values[1] = Int64GetDatum((int64) 1 << i);
+		values[2] = Int64GetDatum(slr_latency_histogram[i]);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * Decide if an order is logged with pg_statement_rollback.log_sample_rate,
+ * the RELEASE and SAVEPOINT of a rollover are logged or not together.
+ */
+static bool
+slr_log_sample(const char *kind)
+{
+	bool		pair = slr_log_after_release && strcmp(kind, "SAVEPOINT") == 0;
+
+	slr_log_after_release = (strcmp(kind, "RELEASE") == 0);
+	if (pair)
+		return slr_log_sampled;
+
+	if (slr_log_sample_rate >= 1.0)
+		slr_log_sampled = true;
+	else if (slr_log_sample_rate <= 0.0)
+		slr_log_sampled = false;
+	else
+#if PG_VERSION_NUM >= 150000
+		slr_log_sampled = pg_prng_double(&pg_global_prng_state) < slr_log_sample_rate;
+#else
+		slr_log_sampled = random() < slr_log_sample_rate * (MAX_RANDOM_VALUE + 1.0);
 #endif
-				if (slr_enabled && name != NULL &&
-						strcmp(name, slr_savepoint_name) != 0)
-					add_savepoint = true;
-				break;
-			case TRANS_STMT_RELEASE:
-				/* do nothing on RELEASE SAVEPOINT call */
-				break;
-			case TRANS_STMT_ROLLBACK_TO:
-				/* explicit SAVEPOINT handling, do nothing */
-				break;
-			default:
-				elog(ERROR, "RSL: Unexpected transaction kind %d.", stmt->kind);
-				break;
+
+	return slr_log_sampled;
+}
+
+/*
+ * Summary of the automatic savepoint orders of the transaction, logged when
+ * log_statement is all, with log_duration or when the cumulative duration
+ * is above log_min_duration_statement.  Like for the orders, the duration is
+ * only reported in the last two cases.  The rollbacks to the automatic
+ * savepoint are the client's ones, their duration is not included.
+ */
+static void
+slr_log_summary_line(void)
+{
+	bool		exceeded;
+	char		msec_str[32];
+
+	if (slr_summary_created == 0 && slr_summary_released == 0 &&
+			slr_summary_rolled_back == 0)
+		return;
+
+	exceeded = (log_min_duration_statement == 0 ||
+				(log_min_duration_statement > 0 &&
+				 slr_summary_time >= log_min_duration_statement));
+	if (!exceeded && !log_duration)
+	{
+		if (LOGSTMT_ALL > log_statement)
+			return;
+
+		ereport(LOG,
+				(errmsg("automatic savepoints: " INT64_FORMAT " created, " INT64_FORMAT " released, " INT64_FORMAT " rolled back to",
+						slr_summary_created, slr_summary_released,
+						slr_summary_rolled_back),
+					errhidestmt(true)));
+		return;
+	}
+
+	snprintf(msec_str, sizeof(msec_str), "%.3f", slr_summary_time);
+	ereport(LOG,
+			(errmsg("automatic savepoints: " INT64_FORMAT " created, " INT64_FORMAT " released, " INT64_FORMAT " rolled back to, duration: %s ms",
+					slr_summary_created, slr_summary_released,
+					slr_summary_rolled_back, msec_str),
+				errhidestmt(true)));
+}
+
+/*
+ * Record an event in the trace buffer of the backend
+ */
+static void
+slr_trace_record(int event, int detail)
+{
+	slrTraceEntry *entry = &slr_trace_buffer[slr_trace_seq % SLR_TRACE_SIZE];
+
+	entry->seq = ++slr_trace_seq;
+	entry->event = (int16) event;
+	entry->executor = (int16) slr_nest_executor_level;
+	entry->planner = (int16) slr_nest_planner_level;
+	entry->nestlevel = (int16) GetCurrentTransactionNestLevel();
+	entry->pending = slr_pending;
+	entry->deferred = slr_defered_save_resowner;
+	entry->detail = detail;
+}
+
+/*
+ * SQL function returning the trace buffer of the backend, oldest event
+ * first.  The detail is the planner hoisting its locks for planner_enter,
+ * the operation or the node tag of the statement for the executor events,
+ * the transaction nest level of the automatic savepoint for the savepoint
+ * events and the packed SQLSTATE of the error for deferred_clear on error,
+ * also returned decoded in the sqlstate column.
+ */
+Datum
+pg_statement_rollback_trace(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	uint64		seq;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Copy the events first, this function records some of its own */
+	seq = slr_trace_seq > SLR_TRACE_SIZE ? slr_trace_seq - SLR_TRACE_SIZE : 0;
+	for (; seq < slr_trace_seq; seq++)
+	{
+		slrTraceEntry *entry = &slr_trace_buffer[seq % SLR_TRACE_SIZE];
+		Datum		values[9];
+		bool		nulls[9];
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = Int64GetDatum((int64) entry->seq);
+		values[1] = CStringGetTextDatum(slr_trace_event_names[entry->event]);
+		values[2] = Int32GetDatum(entry->executor);
+		values[3] = Int32GetDatum(entry->planner);
+		values[4] = Int32GetDatum(entry->nestlevel);
+		values[5] = BoolGetDatum(entry->pending);
+		values[6] = BoolGetDatum(entry->deferred);
+		values[7] = Int32GetDatum(entry->detail);
+		if (entry->event == SLR_TRACE_DEFERRED_CLEAR && entry->detail != 0)
+			values[8] = CStringGetTextDatum(unpack_sql_state(entry->detail));
+		else
+			nulls[8] = true;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+static void
+slr_log(const char *kind, double msec)
+{
+	bool was_logged = false;
+	bool exceeded;
+	char msec_str[32];
+
+	if (strcmp(kind, "SAVEPOINT") == 0)
+		slr_summary_created++;
+	else
+		slr_summary_released++;
+	slr_summary_time += msec;
+
+	/* The summary replaces the orders */
+	if (slr_log_summary || !slr_log_sample(kind))
+		return;
+
+	/* transaction stmt are only logged for log_statement = ALL */
+	if (LOGSTMT_ALL <= log_statement)
+	{
+		ereport(LOG, (errmsg("statement: %s %s; /* automatic savepoint */",
+					kind, slr_savepoint_name),
+					errhidestmt(true)));
+		was_logged = true;
+	}
+
+	/*
+	 * Same rules as check_log_duration(): log_duration only logs the
+	 * duration, a duration above log_min_duration_statement is logged with
+	 * the order unless it has already been.  The duration is the one of the
+	 * order itself, the SAVEPOINT of a rollover is logged when the statement
+	 * has completed but it was timed when it was done.  Since PostgreSQL 12
+	 * all orders of a transaction sampled by log_transaction_sample_rate are
+	 * logged.
+	 */
+	exceeded = (log_min_duration_statement == 0 ||
+				(log_min_duration_statement > 0 &&
+				 msec >= log_min_duration_statement));
+#if PG_VERSION_NUM >= 120000
+	exceeded = exceeded || xact_is_sampled;
+#endif
+	if (!exceeded && !log_duration)
+		return;
+
+	snprintf(msec_str, sizeof(msec_str), "%.3f", msec);
+	if (exceeded && !was_logged)
+		ereport(LOG,
+				(errmsg("duration: %s ms  statement: %s %s; /* automatic savepoint */",
+					msec_str, kind, slr_savepoint_name),
+					errhidestmt(true)));
+	else
+		ereport(LOG,
+				(errmsg("duration: %s ms", msec_str),
+					errhidestmt(true)));
+}
+
+/*
+ * Check that the query does not imply any writes to any tables.  The result
+ * is cached when the query has a queryId, computed by core when
+ * compute_query_id is enabled or by an extension like pg_stat_statements.
+ */
+bool
+slr_is_write_query(QueryDesc *queryDesc)
+{
+	uint64		queryid = (uint64) queryDesc->plannedstmt->queryId;
+	slrQueryEntry *entry;
+	bool		is_write;
+
+	if (queryid == UINT64CONST(0))
+		return slr_scan_write_query(queryDesc);
+
+	if (slr_query_cache == NULL || !slr_query_cache_valid)
+	{
+		HASHCTL		ctl;
+
+		if (slr_query_cache != NULL)
+			hash_destroy(slr_query_cache);
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(uint64);
+		ctl.entrysize = sizeof(slrQueryEntry);
+		slr_query_cache = hash_create("pg_statement_rollback query classification",
+									  128, &ctl, HASH_ELEM | HASH_BLOBS);
+		slr_query_cache_valid = true;
+	}
+
+	entry = (slrQueryEntry *) hash_search(slr_query_cache, &queryid,
+										  HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		entry->last_used = ++slr_query_cache_clock;
+		return entry->is_write;
+	}
+
+	/* Compute before entering the key in case of error */
+	is_write = slr_scan_write_query(queryDesc);
+	if (hash_get_num_entries(slr_query_cache) >= SLR_QUERY_CACHE_MAX)
+		slr_query_cache_evict();
+	entry = (slrQueryEntry *) hash_search(slr_query_cache, &queryid,
+										  HASH_ENTER, NULL);
+	entry->is_write = is_write;
+	entry->last_used = ++slr_query_cache_clock;
+
+	return is_write;
+}
+
+/* qsort comparator of query cache entries, least recently used first */
+static int
+slr_query_entry_cmp(const void *a, const void *b)
+{
+	uint64		la = (*(slrQueryEntry *const *) a)->last_used;
+	uint64		lb = (*(slrQueryEntry *const *) b)->last_used;
+
+	if (la < lb)
+		return -1;
+	else if (la > lb)
+		return 1;
+	return 0;
+}
+
+/*
+ * Remove the SLR_QUERY_CACHE_EVICT percent least recently used entries of the
+ * query cache, like pg_stat_statements does for its own hash table.  The
+ * other classifications stay cached.
+ */
+static void
+slr_query_cache_evict(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	slrQueryEntry **entries;
+	slrQueryEntry *entry;
+	int			nentries = 0;
+	int			nvictims;
+	int			i;
+
+	entries = (slrQueryEntry **)
+		palloc(hash_get_num_entries(slr_query_cache) * sizeof(slrQueryEntry *));
+
+	hash_seq_init(&hash_seq, slr_query_cache);
+	while ((entry = (slrQueryEntry *) hash_seq_search(&hash_seq)) != NULL)
+		entries[nentries++] = entry;
+
+	qsort(entries, nentries, sizeof(slrQueryEntry *), slr_query_entry_cmp);
+
+	nvictims = Max(1, nentries * SLR_QUERY_CACHE_EVICT / 100);
+	nvictims = Min(nvictims, nentries);
+	for (i = 0; i < nvictims; i++)
+		hash_search(slr_query_cache, &entries[i]->queryid, HASH_REMOVE, NULL);
+
+	pfree(entries);
+}
+
+/*
+ * Scan the range table of the query looking for relations with write
+ * permissions.
+ */
+static bool
+slr_scan_write_query(QueryDesc *queryDesc)
+{
+	ListCell   *l;
+
+	/*
+	 * Fail if write permissions are requested in parallel mode for table
+	 * (temp or non-temp), otherwise fail for any non-temp table.  Writes to
+	 * relations excluded by the relation policy are ignored.
+	 */
+	foreach(l, queryDesc->plannedstmt->rtable)
+	{
+		RangeTblEntry *rte = (RangeTblEntry *) lfirst(l);
+
+		if (rte->rtekind != RTE_RELATION)
+			continue;
+
+#if PG_VERSION_NUM < 160000
+		if ((rte->requiredPerms & (~ACL_SELECT)) == 0)
+			continue;
+#else
+		if (rte->perminfoindex != 0)
+		{
+			RTEPermissionInfo *perminfo = localGetRTEPermissionInfo(queryDesc->estate->es_rteperminfos, rte);
+			if ((perminfo->requiredPerms & (~ACL_SELECT)) == 0)
+				continue;
 		}
+#endif
+
+		if (slr_relation_skipped(rte->relid))
+			continue;
+
+		return true;
 	}
-	else if (IsA(parsetree, FetchStmt))
-	{
-		/* do nothing if it's a FETCH */
-	}
-	else if (slr_enabled && ( IsA(parsetree, DeclareCursorStmt) ||
-				IsA(parsetree, PlannedStmt) ) )
+
+	/* Functions writing to tables behind the executor's back */
+	if (slr_function_policy_active() &&
+			slr_plan_calls_writer(queryDesc->plannedstmt))
+		return true;
+
+	return false;
+}
+
+/*
+ * Relation policy: return true if writes to the relation do not need the
+ * automatic savepoint to be renewed.  The result is cached by relation oid.
+ */
+static bool
+slr_relation_skipped(Oid relid)
+{
+	slrRelEntry *entry;
+	bool		skip;
+
+	if (!slr_relation_policy_active())
+		return false;
+
+	if (slr_rel_cache == NULL || !slr_rel_cache_valid)
 	{
-		/* The automatic savepoint is required for DECLARE not PLANNED */
-		release_add_savepoint = IsA(parsetree, DeclareCursorStmt);
+		HASHCTL		ctl;
 
+		if (slr_rel_cache != NULL)
+			hash_destroy(slr_rel_cache);
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(slrRelEntry);
+		slr_rel_cache = hash_create("pg_statement_rollback relation policy",
+									64, &ctl, HASH_ELEM | HASH_BLOBS);
+		slr_rel_cache_valid = true;
 	}
-	else if (!IsA(parsetree, ClosePortalStmt))
+
+	entry = (slrRelEntry *) hash_search(slr_rel_cache, &relid, HASH_FIND, NULL);
+	if (entry != NULL)
+		return entry->skip;
+
+	/* Compute before entering the key in case of error */
+	skip = slr_compute_relation_skipped(relid);
+	entry = (slrRelEntry *) hash_search(slr_rel_cache, &relid, HASH_ENTER, NULL);
+	entry->skip = skip;
+
+	return skip;
+}
+
+/* Is any of the relation policy directives set? */
+static bool
+slr_relation_policy_active(void)
+{
+	return slr_skip_temp_tables || slr_skip_unlogged_tables ||
+		(slr_skip_schemas != NULL && *slr_skip_schemas != '\0') ||
+		(slr_skip_relations != NULL && *slr_skip_relations != '\0');
+}
+
+static bool
+slr_compute_relation_skipped(Oid relid)
+{
+	HeapTuple	tuple;
+	Form_pg_class classForm;
+	bool		skip = false;
+
+	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (!HeapTupleIsValid(tuple))
+		return false;
+	classForm = (Form_pg_class) GETSTRUCT(tuple);
+
+	if (slr_skip_temp_tables && classForm->relpersistence == RELPERSISTENCE_TEMP)
+		skip = true;
+	else if (slr_skip_unlogged_tables &&
+			classForm->relpersistence == RELPERSISTENCE_UNLOGGED)
+		skip = true;
+	else
 	{
-		/*
-		 * release automatic savepoint if any, and create a new one.
-		 * We don't check for the planner stage here, since utilities
-		 * go straight from parsing to executor without a planner stage.
-		 */
-		if (slr_enabled && slr_nest_executor_level == 0)
+		char	   *nspname = get_namespace_name(classForm->relnamespace);
+		char	   *relname = NameStr(classForm->relname);
+		char	   *rawstring;
+		List	   *elemlist;
+		ListCell   *lc;
+
+		if (nspname != NULL && slr_skip_schemas != NULL && *slr_skip_schemas != '\0')
 		{
-			release_add_savepoint = true;
+			rawstring = pstrdup(slr_skip_schemas);
+			if (SplitIdentifierString(rawstring, ',', &elemlist))
+			{
+				foreach(lc, elemlist)
+				{
+					if (strcmp((char *) lfirst(lc), nspname) == 0)
+						skip = true;
+				}
+			}
+			list_free(elemlist);
+			pfree(rawstring);
+		}
 
-			/*
-			 * Future: if this statement type doesn't really need the automatic
-			 * savepoint, add it to the condition above, like ClosePortalStmt.
-			 */
-			elog(DEBUG1, "RSL: ProcessUtility statement type %d, release and add savepoint.",
-					parsetree->type);
+		if (!skip && nspname != NULL && slr_skip_relations_list != NULL)
+		{
+			const char *p = slr_skip_relations_list;
+
+			while (*p != '\0')
+			{
+				const char *rel = p + strlen(p) + 1;
+
+				if (strcmp(p, nspname) == 0 && strcmp(rel, relname) == 0)
+					skip = true;
+				p = rel + strlen(rel) + 1;
+			}
 		}
 	}
 
-	/* Continue the execution of the query */
-	slr_nest_executor_level++;
+	ReleaseSysCache(tuple);
 
-	elog(DEBUG1, "SLR DEBUG: restore ProcessUtility.");
-	/* Excecute the utility command, we are not concerned */
-	PG_TRY();
+	return skip;
+}
+
+/* Relcache callback: forget about the relation, or all of them */
+static void
+slr_relcache_callback(Datum arg, Oid relid)
+{
+	/* The classification of cached queries depends on the policy */
+	if (slr_relation_policy_active())
+		slr_query_cache_valid = false;
+
+	if (slr_rel_cache == NULL || !slr_rel_cache_valid)
+		return;
+
+	if (OidIsValid(relid))
+		hash_search(slr_rel_cache, &relid, HASH_REMOVE, NULL);
+	else
+		slr_rel_cache_valid = false;
+}
+
+/* A schema has been renamed or dropped, forget about all relations */
+static void
+slr_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	slr_rel_cache_valid = false;
+	slr_query_cache_valid = false;
+}
+
+/* The relation policy has changed, forget about all relations and queries */
+static void
+slr_assign_skip_rel_bool(bool newval, void *extra)
+{
+	slr_rel_cache_valid = false;
+	slr_query_cache_valid = false;
+}
+
+static void
+slr_assign_skip_rel_string(const char *newval, void *extra)
+{
+	slr_rel_cache_valid = false;
+	slr_query_cache_valid = false;
+}
+
+/*
+ * Read an identifier, quoted or not, and the blanks following it.  Returns
+ * the name like the parser would see it, or NULL on a syntax error.
+ */
+static char *
+slr_scan_identifier(const char **nextp)
+{
+	const char *p = *nextp;
+	char	   *name;
+
+	if (*p == '"')
 	{
-		if (prev_ProcessUtility)
-			prev_ProcessUtility(SLR_PROCESSUTILITY_ARGS);
-		else
-			standard_ProcessUtility(SLR_PROCESSUTILITY_ARGS);
-		slr_nest_executor_level--;
+		StringInfoData buf;
+
+		/* Quoted name, a doubled quote stands for one quote */
+		initStringInfo(&buf);
+		for (p++;; p++)
+		{
+			if (*p == '\0')
+			{
+				pfree(buf.data);
+				return NULL;	/* mismatched quotes */
+			}
+			if (*p == '"')
+			{
+				if (p[1] != '"')
+					break;
+				p++;
+			}
+			appendStringInfoChar(&buf, *p);
+		}
+		p++;
+		if (buf.len == 0)
+		{
+			pfree(buf.data);
+			return NULL;		/* empty quoted name */
+		}
+		truncate_identifier(buf.data, buf.len, false);
+		name = buf.data;
 	}
-	PG_CATCH();
+	else
 	{
-		slr_nest_executor_level--;
-		PG_RE_THROW();
+		const char *start = p;
+
+		/* Unquoted name, ends at a separator or a blank */
+		while (*p != '\0' && *p != ',' && *p != '.' && !scanner_isspace(*p))
+			p++;
+		if (p == start)
+			return NULL;
+		name = downcase_truncate_identifier(start, p - start, false);
 	}
-	PG_END_TRY();
 
-	/* SPI calls are internal */
-	if (dest->mydest == DestSPI
-#if PG_VERSION_NUM >= 90500
-			|| IN_PARALLEL_WORKER
-#endif
-			)
+	while (scanner_isspace(*p))
+		p++;
+	*nextp = p;
+
+	return name;
+}
+
+/*
+ * Check hook for pg_statement_rollback.skip_relations: the comma separated
+ * list of schema qualified names, quoted like in SQL, is stored as
+ * consecutive pairs of nul-terminated schema and relation names, ended by an
+ * empty string.  Entries that are not schema qualified are rejected.
+ */
+static bool
+slr_check_skip_relations(char **newval, void **extra, GucSource source)
+{
+	const char *p = *newval;
+	StringInfoData buf;
+	char	   *list;
+
+	initStringInfo(&buf);
+
+	while (scanner_isspace(*p))
+		p++;
+	while (*p != '\0')
 	{
-		/* do nothing and get out */
-		return;
+		char	   *nspname;
+		char	   *relname = NULL;
+
+		nspname = slr_scan_identifier(&p);
+		if (nspname != NULL && *p == '.')
+		{
+			p++;
+			while (scanner_isspace(*p))
+				p++;
+			relname = slr_scan_identifier(&p);
+		}
+		if (relname == NULL || (*p != ',' && *p != '\0'))
+		{
+			GUC_check_errdetail("List syntax is invalid, expected a comma separated list of schema qualified relation names.");
+			pfree(buf.data);
+			return false;
+		}
+		appendBinaryStringInfo(&buf, nspname, strlen(nspname) + 1);
+		appendBinaryStringInfo(&buf, relname, strlen(relname) + 1);
+		pfree(nspname);
+		pfree(relname);
+
+		if (*p == ',')
+		{
+			/* a name is expected after the comma */
+			p++;
+			while (scanner_isspace(*p))
+				p++;
+			if (*p == '\0')
+			{
+				GUC_check_errdetail("List syntax is invalid, expected a comma separated list of schema qualified relation names.");
+				pfree(buf.data);
+				return false;
+			}
+		}
 	}
 
-	/*
-	 * RELEASE and add a SAVEPOINT if we just executed a statement
-	 * that should not rollback on failure of future statement failures
-	 */
-	if (release_add_savepoint)
+	/* The buffer is nul-terminated, which ends the list */
+	list = slr_guc_malloc(buf.len + 1);
+	if (list == NULL)
 	{
-		elog(DEBUG1, "RSL: ProcessUtility release and add savepoint (slr_nest_executor_level %d, slr_planner_done %d).",
-				slr_nest_executor_level, slr_planner_done);
-		release_add_savepoint = false;
-		/*
-		 * save the current resowner, all caches are associated to it, it'll be
-		 * restored after the automatic SAVEPOINT will be created
-		 */
-		slr_save_resowner();
-		/* Release an automatic SAVEPOINT if there's one */
-		slr_release_savepoint();
-		/* And create a new one */
-		slr_add_savepoint();
+		pfree(buf.data);
+		return false;
 	}
-	/* Add an initial SAVEPOINT if we just opened a transaction */
-	else if (add_savepoint)
-	{
-		elog( DEBUG1, "RSL: ProcessUtility add savepoint (slr_nest_executor_level %d, slr_planner_done %d).",
-				slr_nest_executor_level, slr_planner_done);
+	memcpy(list, buf.data, buf.len + 1);
+	pfree(buf.data);
 
-		/*
-		 * save the current resowner, all caches are associated to it, it'll be
-		 * restored after the automatic SAVEPOINT will be created
-		 */
-		slr_save_resowner();
+	*extra = list;
 
-		/* make sure the transaction opening has been processed */
-		CommitTransactionCommand();
-		CommandCounterIncrement();
+	return true;
+}
 
-		/*
-		 * and create our savepoint. We don't check for the planner stage here,
-		 * since utilities go straight from parsing to executor without a
-		 * planner stage.
-		 */
-		slr_add_savepoint();
+static void
+slr_assign_skip_relations(const char *newval, void *extra)
+{
+	slr_skip_relations_list = (char *) extra;
+	slr_rel_cache_valid = false;
+	slr_query_cache_valid = false;
+}
 
-		/* reset the flag to be extra safe */
-		add_savepoint = false;
-	}
-	else if (slr_defered_save_resowner)
-	{
-		elog(DEBUG1, "RSL: ProcessUtility release and add savepoint (slr_nest_executor_level %d, slr_planner_done %d).",
-				slr_nest_executor_level, slr_planner_done);
+/* Is any of the function policy directives set? */
+static bool
+slr_function_policy_active(void)
+{
+	return slr_volatile_c_functions_write ||
+		(slr_write_functions != NULL && *slr_write_functions != '\0');
+}
 
-		/*
-		 * save the current resowner, all caches are associated to it, it'll be
-		 * restored after the automatic SAVEPOINT will be created
-		 */
-		slr_save_resowner();
+/*
+ * Function policy: return true if the plan of the statement, or one of its
+ * subplans, calls a function that may write to tables.
+ */
+static bool
+slr_plan_calls_writer(PlannedStmt *stmt)
+{
+	ListCell   *lc;
 
-		/* Release an automatic SAVEPOINT if there's one */
-		slr_release_savepoint();
-		/* And create a new one */
-		slr_add_savepoint();
+	if (slr_plan_walker(stmt->planTree))
+		return true;
 
+	foreach(lc, stmt->subplans)
+	{
+		if (slr_plan_walker((Plan *) lfirst(lc)))
+			return true;
 	}
 
-	/* reset defered savepoint */
-	slr_defered_save_resowner = false;
+	return false;
 }
 
 /*
- * ExecutorStart hook: release automatic savepoint if exists and create a new
- * one.  Be careful though, the planner can spawn multiple level of executors,
- * and we can't interfere with savepoints at that time.  We detect that we
- * passed the planner stage with the planner hook.
+ * Look for function calls in the target list and quals of the plan nodes, in
+ * the function and VALUES scans and in the constant quals.
  */
-static void
-slr_ExecutorStart(QueryDesc *queryDesc, int eflags)
+static bool
+slr_plan_walker(Plan *plan)
 {
-	if (prev_ExecutorStart)
-		prev_ExecutorStart(queryDesc, eflags);
-	else
-		standard_ExecutorStart(queryDesc, eflags);
+	List	   *children = NIL;
+	ListCell   *lc;
 
-#if PG_VERSION_NUM >= 90500
-	if IN_PARALLEL_WORKER
-		return;
-#endif
+	if (plan == NULL)
+		return false;
 
-	/*
-	 * Only handle savepoints for top level executor that's not spawned by the
-	 * planner for insert/update/delete (writer).
-	 * After a SELECT function call that have write statement inside we need to
-	 * issue a RELEASE+SAVEPOINT. In this case slr_defered_save_resowner have
-	 * been set in nested executor level call at bottom of this function.
-	 */
-	elog(DEBUG1, "RSL: ExecutorStart (slr_nest_executor_level %d, slr_planner_done %d, operation %d).",
-			slr_nest_executor_level, slr_planner_done, queryDesc->operation);
+	check_stack_depth();
+
+	if (slr_expr_calls_writer((Node *) plan->targetlist, NULL) ||
+			slr_expr_calls_writer((Node *) plan->qual, NULL))
+		return true;
 
-	if (slr_enabled && slr_nest_executor_level == 0 && slr_planner_done)
+	switch (nodeTag(plan))
 	{
-		elog(DEBUG1, "RSL: ExecutorStart save ResourcesOwner.");
-		/*
-		* save the resowner, all caches are associated to it, it'll be
-		* restored just after we define the SAVEPOINT
-		*/
-		slr_save_resowner();
+		case T_Result:
+			if (slr_expr_calls_writer(((Result *) plan)->resconstantqual, NULL))
+				return true;
+			break;
+		case T_FunctionScan:
+			if (slr_expr_calls_writer((Node *) ((FunctionScan *) plan)->functions, NULL))
+				return true;
+			break;
+		case T_ValuesScan:
+			if (slr_expr_calls_writer((Node *) ((ValuesScan *) plan)->values_lists, NULL))
+				return true;
+			break;
+		case T_SubqueryScan:
+			if (slr_plan_walker(((SubqueryScan *) plan)->subplan))
+				return true;
+			break;
+		case T_Append:
+			children = ((Append *) plan)->appendplans;
+			break;
+		case T_MergeAppend:
+			children = ((MergeAppend *) plan)->mergeplans;
+			break;
+		case T_BitmapAnd:
+			children = ((BitmapAnd *) plan)->bitmapplans;
+			break;
+		case T_BitmapOr:
+			children = ((BitmapOr *) plan)->bitmapplans;
+			break;
+#if PG_VERSION_NUM < 140000
+		case T_ModifyTable:
+			children = ((ModifyTable *) plan)->plans;
+			break;
+#endif
+		case T_CustomScan:
+			children = ((CustomScan *) plan)->custom_plans;
+			break;
+		default:
+			break;
 	}
 
-	/*
-	 * if function has write statement we must generate a
-	 * release/savepoint after the call to the function.
-	 */
-	if (slr_enabled && slr_nest_executor_level > 0 && slr_planner_done &&
-			slr_enable_writeonly &&
-			slr_is_write_query(queryDesc) 
-		)
+	foreach(lc, children)
 	{
-		elog(DEBUG1, "RSL: ExecutorStart enable slr_defered_save_resowner.");
-		slr_defered_save_resowner = true;
+		if (slr_plan_walker((Plan *) lfirst(lc)))
+			return true;
 	}
+
+	return slr_plan_walker(plan->lefttree) || slr_plan_walker(plan->righttree);
 }
 
-/*
- * ExecutorRun hook: we track nesting depth, and RELEASE / SAVEPOINT for top
- * level executor.
- */
-static void
-slr_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+static bool
+slr_expr_calls_writer(Node *node, void *context)
+{
+	if (node == NULL)
+		return false;
+
 #if PG_VERSION_NUM >= 90600
-                 uint64 count
+	if (check_functions_in_node(node, slr_function_may_write, context))
+		return true;
 #else
-                 long count
-#endif
-#if PG_VERSION_NUM >= 100000
-                 , bool execute_once
+	if (IsA(node, FuncExpr) &&
+			slr_function_may_write(((FuncExpr *) node)->funcid, context))
+		return true;
 #endif
-	)
+
+	return expression_tree_walker(node, slr_expr_calls_writer, context);
+}
+
+/*
+ * Return true if a call to the function needs the automatic savepoint to be
+ * renewed.  The result is cached by function oid.
+ */
+static bool
+slr_function_may_write(Oid funcid, void *context)
+{
+	slrFuncEntry *entry;
+	bool		may_write;
+
+	if (slr_func_cache == NULL || !slr_func_cache_valid)
+	{
+		HASHCTL		ctl;
+
+		if (slr_func_cache != NULL)
+			hash_destroy(slr_func_cache);
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(slrFuncEntry);
+		slr_func_cache = hash_create("pg_statement_rollback function policy",
+									 64, &ctl, HASH_ELEM | HASH_BLOBS);
+		slr_func_cache_valid = true;
+	}
+
+	entry = (slrFuncEntry *) hash_search(slr_func_cache, &funcid, HASH_FIND, NULL);
+	if (entry != NULL)
+		return entry->may_write;
+
+	/* Compute before entering the key in case of error */
+	may_write = slr_compute_function_may_write(funcid);
+	entry = (slrFuncEntry *) hash_search(slr_func_cache, &funcid, HASH_ENTER, NULL);
+	entry->may_write = may_write;
+
+	return may_write;
+}
+
+/*
+ * Functions listed in write_functions may write, those listed in
+ * readonly_functions never write.  Otherwise, with volatile_c_functions_write,
+ * a volatile function written in C may write.  Immutable and stable functions
+ * cannot modify the database and writes done by functions in SQL or in a
+ * procedural language go through the executor and are already detected.
+ */
+static bool
+slr_compute_function_may_write(Oid funcid)
+{
+	HeapTuple	tuple;
+	Form_pg_proc procForm;
+	char	   *nspname;
+	bool		may_write = false;
+
+	tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(funcid));
+	if (!HeapTupleIsValid(tuple))
+		return false;
+	procForm = (Form_pg_proc) GETSTRUCT(tuple);
+	nspname = get_namespace_name(procForm->pronamespace);
+
+	if (slr_function_listed(slr_write_functions, nspname, NameStr(procForm->proname)))
+		may_write = true;
+	else if (slr_function_listed(slr_readonly_functions, nspname, NameStr(procForm->proname)))
+		may_write = false;
+	else if (slr_volatile_c_functions_write &&
+			procForm->provolatile == PROVOLATILE_VOLATILE &&
+			(procForm->prolang == ClanguageId ||
+			 procForm->prolang == INTERNALlanguageId))
+		may_write = true;
+
+	ReleaseSysCache(tuple);
+
+	return may_write;
+}
+
+/* Is the function listed, by its name or its schema qualified name? */
+static bool
+slr_function_listed(const char *list, const char *nspname, const char *proname)
 {
-	elog(DEBUG1, "RSL: ExecutorRun increasing slr_nest_executor_level.");
-	slr_nest_executor_level++;
+	char	   *rawstring;
+	char	   *qualname = NULL;
+	List	   *elemlist;
+	ListCell   *lc;
+	bool		found = false;
 
-	PG_TRY();
-	{
-		if (prev_ExecutorRun)
-#if PG_VERSION_NUM >= 100000
-			prev_ExecutorRun(queryDesc, direction, count, execute_once);
-#else
-			prev_ExecutorRun(queryDesc, direction, count);
-#endif
-		else
-#if PG_VERSION_NUM >= 100000
-			standard_ExecutorRun(queryDesc, direction, count, execute_once);
-#else
-			standard_ExecutorRun(queryDesc, direction, count);
-#endif
-		elog(DEBUG1, "RSL: ExecutorRun decreasing slr_nest_executor_level.");
-		slr_nest_executor_level--;
-	}
-	PG_CATCH();
+	if (list == NULL || *list == '\0')
+		return false;
+
+	if (nspname != NULL)
+		qualname = psprintf("%s.%s", nspname, proname);
+
+	rawstring = pstrdup(list);
+	if (SplitIdentifierString(rawstring, ',', &elemlist))
 	{
-		elog(DEBUG1, "RSL: ExecutorRun decreasing slr_nest_executor_level.");
-		slr_nest_executor_level--;
-		PG_RE_THROW();
+		foreach(lc, elemlist)
+		{
+			char	   *elem = (char *) lfirst(lc);
+
+			if (strcmp(elem, proname) == 0 ||
+					(qualname != NULL && strcmp(elem, qualname) == 0))
+				found = true;
+		}
 	}
-	PG_END_TRY();
+	list_free(elemlist);
+	pfree(rawstring);
+	if (qualname != NULL)
+		pfree(qualname);
+
+	return found;
 }
 
-/*
- * ExecutorFinish hook: all we need do is track nesting depth
- */
+/* A function has been created, altered or dropped, forget about all of them */
 static void
-slr_ExecutorFinish(QueryDesc *queryDesc)
+slr_proc_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
 {
+	slr_func_cache_valid = false;
+	if (slr_function_policy_active())
+		slr_query_cache_valid = false;
+}
 
-	elog(DEBUG1, "RSL: ExecutorFinish increasing slr_nest_executor_level.");
-	slr_nest_executor_level++;
+/* The function policy has changed, forget about all functions and queries */
+static void
+slr_assign_function_bool(bool newval, void *extra)
+{
+	slr_func_cache_valid = false;
+	slr_query_cache_valid = false;
+}
+
+static void
+slr_assign_function_string(const char *newval, void *extra)
+{
+	slr_func_cache_valid = false;
+	slr_query_cache_valid = false;
+}
+
+#define SLR_KEYWORD_IS(p, len, kw) \
+	((len) == (int) strlen(kw) && pg_strncasecmp((p), (kw), (len)) == 0)
 
-	PG_TRY();
+/*
+ * Skip blanks, comments and statement separators in a query string and
+ * return a pointer to the next keyword.  Its length is stored in *len.
+ */
+static const char *
+slr_next_keyword(const char *p, int *len)
+{
+	*len = 0;
+
+	for (;;)
 	{
-		if (prev_ExecutorFinish)
-			prev_ExecutorFinish(queryDesc);
+		if (*p == '\0')
+			return p;
+		else if (isspace((unsigned char) *p) || *p == ';')
+			p++;
+		else if (p[0] == '-' && p[1] == '-')
+		{
+			while (*p != '\0' && *p != '\n')
+				p++;
+		}
+		else if (p[0] == '/' && p[1] == '*')
+		{
+			int		depth = 1;
+
+			/* C-style comments can be nested */
+			p += 2;
+			while (*p != '\0' && depth > 0)
+			{
+				if (p[0] == '/' && p[1] == '*')
+				{
+					depth++;
+					p += 2;
+				}
+				else if (p[0] == '*' && p[1] == '/')
+				{
+					depth--;
+					p += 2;
+				}
+				else
+					p++;
+			}
+		}
 		else
-			standard_ExecutorFinish(queryDesc);
-		slr_nest_executor_level--;
-		elog(DEBUG1, "RSL: ExecutorFinish decreasing slr_nest_executor_level.");
-	}
-	PG_CATCH();
-	{
-		slr_nest_executor_level--;
-		elog(DEBUG1, "RSL: ExecutorFinish decreasing slr_nest_executor_level.");
-		PG_RE_THROW();
+			break;
 	}
-	PG_END_TRY();
+
+	while (isalpha((unsigned char) p[*len]) || p[*len] == '_')
+		(*len)++;
+
+	return p;
 }
 
-/* ExecutorEnd hook: for write statements, release automatic savepoint and
- * create a new one.
- * Be careful though, the planner can spawn multiple level of executors,
- * and we can't interfere with savepoints at that time.  We detect that we
- * passed the planner stage with the planner hook.
+/*
+ * Return true if the current automatic savepoint can be kept instead of being
+ * released and created again: it must be the current subtransaction and no
+ * transaction id must have been assigned to it, which means that nothing has
+ * been written since it was created.  Utilities with effects that are undone
+ * by a ROLLBACK TO without requiring a transaction id (cursors, settings,
+ * locks, notifications) always renew the savepoint.
  */
-static void
-slr_ExecutorEnd(QueryDesc *queryDesc)
+static bool
+slr_savepoint_unused(Node *parsetree)
 {
-	/*
-	 * Only handle automatic savepoints for top level executor that's not
-	 * spawned by the planner for write SQL (like slr_ExecutorStart()).
-	 */
-	elog( DEBUG1, "RSL: ExecutorEnd (slr_nest_executor_level %d, slr_planner_done %d, operation %d).",
-			slr_nest_executor_level, slr_planner_done, queryDesc->operation);
+	if (!slr_reuse_savepoint || !slr_pending)
+		return false;
 
-	if (
-#if PG_VERSION_NUM >= 90500
-		!IN_PARALLEL_WORKER &&
-#endif
-		slr_enabled && slr_nest_executor_level == 0 && slr_planner_done && (
-				!slr_enable_writeonly ||
-			 	slr_defered_save_resowner ||
-			 	slr_is_write_query(queryDesc) 
-			 )
-		)
-	{
-		/* Release an automatic SAVEPOINT if there's one */
-		slr_release_savepoint();
-		/* And create a new one */
-		slr_add_savepoint();
+	if (slr_savepoint_nestlevel != GetCurrentTransactionNestLevel())
+		return false;
 
-		slr_defered_save_resowner = false;
-	}
+	if (parsetree != NULL && (IsA(parsetree, DeclareCursorStmt) ||
+				IsA(parsetree, VariableSetStmt) ||
+				IsA(parsetree, LockStmt) ||
+				IsA(parsetree, ListenStmt) ||
+				IsA(parsetree, UnlistenStmt) ||
+				IsA(parsetree, NotifyStmt)))
+		return false;
 
-	if (prev_ExecutorEnd)
-		prev_ExecutorEnd(queryDesc);
-	else
-		standard_ExecutorEnd(queryDesc);
+	return !TransactionIdIsValid(GetCurrentTransactionIdIfAny());
 }
 
 /*
- * This function set the current resowner to the one that has been created by
- * DefineSavepoint(), after it has been overriden by slr_save_resowner')
+ * Granularity policy: a statement requiring the automatic savepoint to be
+ * renewed is counted and the rollover is only done when
+ * pg_statement_rollback.rollover_every statements have been executed or
+ * pg_statement_rollback.rollover_interval has elapsed since the previous
+ * one.  On error, the client rolls back to this last checkpoint.
  */
-void
-slr_restore_resowner(void)
+static bool
+slr_rollover_due(void)
 {
-	Assert(slr_nest_executor_level == 0);
+	/* There is no automatic savepoint yet */
+	if (!slr_pending)
+		return true;
 
-	if (slr_enabled && slr_xact_opened && newresowner != NULL)
-	{
-		CurrentResourceOwner = newresowner;
-		newresowner = NULL;
+	slr_stmt_count++;
 
-		elog(DEBUG1, "RSL: restoring Resource owner.");
-		slr_log("SAVEPOINT");
-	}
+	/* Keep the current savepoint once the memory bound has been reached */
+	if (slr_retained_memory_exceeded())
+		return false;
+
+	/* Default, renew the savepoint after each statement */
+	if (slr_rollover_every <= 1 && slr_rollover_interval <= 0)
+		return true;
+
+	if (slr_rollover_every > 0 && slr_stmt_count >= slr_rollover_every)
+		return true;
+
+	if (slr_rollover_interval > 0 &&
+			TimestampDifferenceExceeds(slr_last_rollover, GetCurrentTimestamp(),
+									   slr_rollover_interval))
+		return true;
+
+	return false;
 }
 
 /*
- * This function save the current resowner, that'll be overriden by
- * DefineSavepoint)
+ * Per-statement opt-out: return true if pg_statement_rollback.no_autosavepoint
+ * was set when the statement started, given by no_autosavepoint, or if the
+ * statement starts with a hint, a C-style comment opened by a plus sign,
+ * containing the no_autosavepoint keyword.
  */
-void
-slr_save_resowner(void)
+static bool
+slr_statement_opted_out(bool no_autosavepoint, const char *sourceText,
+						int stmt_location)
 {
-	Assert(oldresowner == NULL);
-	Assert(slr_nest_executor_level == 0);
+	const char *p;
 
-	if (slr_enabled && slr_xact_opened)
+	if (no_autosavepoint)
+		return true;
+
+	if (sourceText == NULL)
+		return false;
+
+	p = sourceText + Max(stmt_location, 0);
+	while (isspace((unsigned char) *p))
+		p++;
+
+	if (strncmp(p, "/*+", 3) != 0)
+		return false;
+
+	/* Look for the keyword in the hint comment */
+	p += 3;
+	while (*p != '\0' && !(p[0] == '*' && p[1] == '/'))
 	{
-		oldresowner = CurrentResourceOwner;
-		elog(DEBUG1, "RSL: Saving the Resource owner.");
-		slrPortalContext = PortalContext;
+		int		len = 0;
+
+		while (isalnum((unsigned char) p[len]) || p[len] == '_')
+			len++;
+
+		if (len == 0)
+			p++;
+		else if (SLR_KEYWORD_IS(p, len, "no_autosavepoint"))
+			return true;
+		else
+			p += len;
 	}
+
+	return false;
 }
 
 /*
- * This function create a new savepoint.  However, adding a SAVEPOINT will
- * create a new resowner, and we can't let the new resowner at this point,
- * because following query execution will have to clear all entries associated
- * to the former resowner.  Therefore, we backup the new resowner, which will
- * be restored after the cleanup is done.  There's no hook available to do
- * that, so we rely on the current query context (PortalContext) cleanup
- * callback to do this.
+ * Return the first keyword of the statement following the current one in
+ * the query string, NULL if its position is unknown or if the statement
+ * extends to the end of the string.
  */
-void
-slr_add_savepoint(void)
+static const char *
+slr_next_stmt(const char *sourceText, int stmt_location, int stmt_len, int *len)
 {
-	Assert(slr_nest_executor_level == 0);
+	if (sourceText == NULL || stmt_location < 0 || stmt_len <= 0)
+		return NULL;
 
-	if (slr_enabled && slr_xact_opened)
-	{
-		MemoryContextCallback *slr_cb = NULL;
+	if ((size_t) (stmt_location + stmt_len) > strlen(sourceText))
+		return NULL;
 
-		elog(DEBUG1, "RSL: adding savepoint %s.", slr_savepoint_name);
+	return slr_next_keyword(sourceText + stmt_location + stmt_len, len);
+}
 
-		/* Define savepoint */
-		DefineSavepoint(slr_savepoint_name);
-		elog(DEBUG1, "RSL: CommitTransactionCommand.");
-		CommitTransactionCommand();
-		elog(DEBUG1, "RSL: CommandCounterIncrement.");
-		CommandCounterIncrement();
+/*
+ * pq_buffer_has_data() is only available in recent minor versions
+ */
+#if PG_VERSION_NUM >= 140001 || \
+	(PG_VERSION_NUM >= 130005 && PG_VERSION_NUM < 140000) || \
+	(PG_VERSION_NUM >= 120009 && PG_VERSION_NUM < 130000) || \
+	(PG_VERSION_NUM >= 110014 && PG_VERSION_NUM < 120000) || \
+	(PG_VERSION_NUM >= 100019 && PG_VERSION_NUM < 110000)
+#define SLR_HAS_PQ_BUFFER_HAS_DATA
+#endif
 
-		/*
-		 * Backup the new resowner, will be restore the end of execution on the
-		 * Portal memory context callback
-		 */
-		newresowner = CurrentResourceOwner;
+/*
+ * Per message granularity: return true if the current statement is not the
+ * last one of the client message, the rollover is then deferred.  With the
+ * simple query protocol, the message is the query string.  With the extended
+ * query protocol, when the client has already sent the following messages of
+ * a pipeline, the next message type is looked at without consuming it: the
+ * segment goes on until a Sync.  If nothing has been received yet the
+ * segment is considered finished, which is always safe.
+ */
+static bool
+slr_message_pending(const char *sourceText, int stmt_location, int stmt_len)
+{
+	const char *p;
+	int			len;
 
-		/* And restore the one we previously saved */
-		if (oldresowner == NULL)
-			elog(ERROR, "Automatic savepoint internal error, no resource owner.");
-		if (slrPortalContext == NULL)
-			elog(ERROR, "Automatic savepoint internal error, no portal context.");
+	if (!slr_rollover_per_message)
+		return false;
 
-		CurrentResourceOwner = oldresowner;
-		oldresowner = NULL;
+	/* Other statements follow in the query string */
+	p = slr_next_stmt(sourceText, stmt_location, stmt_len, &len);
+	if (p != NULL && *p != '\0')
+		return true;
 
-		/*
-		 * Add the callback that will restore the new resowner when the cleanup
-		 * will be finished
-		 */
-		slr_cb = MemoryContextAlloc(slrPortalContext, sizeof(MemoryContextCallback));
-		slr_cb->arg = NULL;
-		slr_cb->func = (void *) slr_restore_resowner;
-		elog(DEBUG1, "RSL: add the callback that will restore the new resowner when the cleanup.");
-		MemoryContextRegisterResetCallback(slrPortalContext, slr_cb);
-		slrPortalContext = NULL;
+#ifdef SLR_HAS_PQ_BUFFER_HAS_DATA
+	if (whereToSendOutput == DestRemote && pq_buffer_has_data())
+	{
+		int		msgtype;
 
-		slr_pending = true;
+		pq_startmsgread();
+		msgtype = pq_peekbyte();
+		pq_endmsgread();
+
+		switch (msgtype)
+		{
+			case 'P':		/* Parse */
+			case 'B':		/* Bind */
+			case 'E':		/* Execute */
+			case 'D':		/* Describe */
+			case 'C':		/* Close */
+			case 'H':		/* Flush */
+				return true;
+			default:
+				break;
+		}
 	}
+#endif
+
+	return false;
 }
 
 /*
- * This function release an automatic SAVEPOINT that
- * has previously been created
+ * Return false if the utility statement does not need the automatic savepoint
+ * to be renewed after it: it is in the built-in table of harmless utilities or
+ * its command tag is listed in pg_statement_rollback.skip_utilities.
  */
-void
-slr_release_savepoint(void)
+static bool
+slr_utility_needs_savepoint(Node *parsetree)
 {
-	Assert(slr_nest_executor_level == 0);
+	const char *p;
+	const char *tagname;
+	int			i;
 
-	if (slr_enabled && slr_xact_opened && slr_pending)
+	for (i = 0; i < lengthof(slr_harmless_utilities); i++)
 	{
-#if PG_VERSION_NUM < 110000
-		List       *options = NIL;
-		DefElem    *elem = NULL;
+		if (nodeTag(parsetree) == slr_harmless_utilities[i].tag &&
+				(slr_harmless_utilities[i].harmless == NULL ||
+				 slr_harmless_utilities[i].harmless(parsetree)))
+			return false;
+	}
 
-		elog(DEBUG1, "RSL: releasing savepoint %s.", slr_savepoint_name);
+	if (slr_skip_utilities_list == NULL || *slr_skip_utilities_list == '\0')
+		return true;
 
-		elem = makeDefElem("savepoint_name",
-				(Node *) makeString(slr_savepoint_name)
-#if PG_VERSION_NUM >= 100000
-				, -1
+#if PG_VERSION_NUM >= 130000
+	tagname = GetCommandTagName(CreateCommandTag(parsetree));
+#else
+	tagname = CreateCommandTag(parsetree);
 #endif
-				);
+	for (p = slr_skip_utilities_list; *p != '\0'; p += strlen(p) + 1)
+	{
+		if (pg_strcasecmp(p, tagname) == 0)
+			return false;
+	}
 
-		options = list_make1(elem);
+	return true;
+}
 
-		ReleaseSavepoint(options);
-#else
-		ReleaseSavepoint(slr_savepoint_name);
-#endif
-		CommitTransactionCommand();
-		CommandCounterIncrement();
+/* EXPLAIN is harmless unless the statement is executed */
+static bool
+slr_explain_no_analyze(Node *parsetree)
+{
+	ListCell   *lc;
 
-		slr_pending = false;
+	foreach(lc, ((ExplainStmt *) parsetree)->options)
+	{
+		DefElem    *opt = (DefElem *) lfirst(lc);
 
-		/* Manually log the order if needed */
-		slr_log("RELEASE");
+		if (strcmp(opt->defname, "analyze") == 0)
+			return !defGetBoolean(opt);
 	}
+
+	return true;
 }
 
-static void
-slr_log(const char *kind)
+/*
+ * Memory for the extra of a check hook, released by guc.c with free() or,
+ * since PostgreSQL 16, with guc_free().
+ */
+static void *
+slr_guc_malloc(size_t size)
 {
-	bool was_logged = false;
+#if PG_VERSION_NUM >= 160000
+	return guc_malloc(LOG, size);
+#else
+	return malloc(size);
+#endif
+}
 
-	/* transaction stmt are only logged for log_statement = ALL */
-	if (LOGSTMT_ALL <= log_statement)
-	{
-		ereport(LOG, (errmsg("statement: %s %s; /* automatic savepoint */",
-					kind, slr_savepoint_name),
-					errhidestmt(true)));
-		was_logged = true;
-	}
+/*
+ * Check hook for pg_statement_rollback.skip_utilities: the comma separated
+ * list is stored as consecutive nul-terminated command tags, ended by an
+ * empty string.
+ */
+static bool
+slr_check_skip_utilities(char **newval, void **extra, GucSource source)
+{
+	const char *src = *newval;
+	char	   *list;
+	char	   *dst;
 
-	/*
-	 * If log_duration and log_min_duration_statement is st to 0, always log
-	 * these queries. We don't compute the actual duration for now, but it could
-	 * be added if needed.  The main problem to compute duration is that the
-	 * SAVEPOINT creation is actually done in two steps, which makes the timing
-	 * not really meaningful.  Instead, display a "0.01" as duration.
-	 */
-	if (log_duration || log_min_duration_statement == 0)
+	list = slr_guc_malloc(strlen(src) + 2);
+	if (list == NULL)
+		return false;
+
+	dst = list;
+	while (*src != '\0')
 	{
-		if (was_logged)
-			ereport(LOG,
-					(errmsg("duration: %s ms", "0.01"),
-						errhidestmt(true)));
-		else
-			ereport(LOG,
-					(errmsg("duration: %s ms  statement: %s %s; /* automatic savepoint */",
-						"0.01", kind, slr_savepoint_name),
-						errhidestmt(true)));
+		const char *end;
+
+		while (isspace((unsigned char) *src) || *src == ',')
+			src++;
+		if (*src == '\0')
+			break;
+
+		end = src;
+		while (*end != '\0' && *end != ',')
+			end++;
+
+		/* copy the tag without trailing blanks */
+		while (end > src && isspace((unsigned char) end[-1]))
+			end--;
+		memcpy(dst, src, end - src);
+		dst += end - src;
+		*dst++ = '\0';
+
+		src = end;
+		while (*src != '\0' && *src != ',')
+			src++;
 	}
+	*dst = '\0';
+
+	*extra = list;
+
+	return true;
+}
+
+static void
+slr_assign_skip_utilities(const char *newval, void *extra)
+{
+	slr_skip_utilities_list = (char *) extra;
 }
 
 /*
- * Check that the query does not imply any writes to any tables.
+ * Look at the statement following the current one in a multi-statement query
+ * string and return true if it ends the transaction block: COMMIT, END,
+ * ABORT, ROLLBACK (but not ROLLBACK TO) or PREPARE TRANSACTION.  Renewing
+ * the automatic savepoint just before such a statement is useless.
  */
-bool
-slr_is_write_query(QueryDesc *queryDesc)
+static bool
+slr_next_stmt_ends_xact(const char *sourceText, int stmt_location, int stmt_len)
 {
-	ListCell   *l;
+	const char *p;
+	int			len;
 
-	/*
-	 * Fail if write permissions are requested in parallel mode for table
-	 * (temp or non-temp), otherwise fail for any non-temp table.
-	 */
-	foreach(l, queryDesc->plannedstmt->rtable)
-	{
-		RangeTblEntry *rte = (RangeTblEntry *) lfirst(l);
+	p = slr_next_stmt(sourceText, stmt_location, stmt_len, &len);
+	if (p == NULL)
+		return false;
 
-		if (rte->rtekind != RTE_RELATION)
-			continue;
+	if (SLR_KEYWORD_IS(p, len, "COMMIT") || SLR_KEYWORD_IS(p, len, "END") ||
+			SLR_KEYWORD_IS(p, len, "ABORT"))
+		return true;
 
-#if PG_VERSION_NUM < 160000
-		if ((rte->requiredPerms & (~ACL_SELECT)) == 0)
-			continue;
-#else
-		if (rte->perminfoindex != 0)
-		{
-			RTEPermissionInfo *perminfo = localGetRTEPermissionInfo(queryDesc->estate->es_rteperminfos, rte);
-			if ((perminfo->requiredPerms & (~ACL_SELECT)) == 0)
-				continue;
-		}
-#endif
+	if (SLR_KEYWORD_IS(p, len, "PREPARE"))
+	{
+		p = slr_next_keyword(p + len, &len);
+		return SLR_KEYWORD_IS(p, len, "TRANSACTION");
+	}
 
-		return true;
+	if (SLR_KEYWORD_IS(p, len, "ROLLBACK"))
+	{
+		p = slr_next_keyword(p + len, &len);
+		if (SLR_KEYWORD_IS(p, len, "WORK") || SLR_KEYWORD_IS(p, len, "TRANSACTION"))
+			p = slr_next_keyword(p + len, &len);
+		/* ROLLBACK TO SAVEPOINT needs the automatic savepoint */
+		return !SLR_KEYWORD_IS(p, len, "TO");
 	}
 
 	return false;
@@ -880,8 +4589,11 @@ static void
 disable_differed_slr(ErrorData *edata)
 {
 	/* Do not ask for automatic savepoint if previous statement has an error */
-	if (edata->elevel >= ERROR)
+	if (edata->elevel >= ERROR && slr_defered_save_resowner)
+	{
+		SLR_TRACE(deferred__clear, SLR_TRACE_DEFERRED_CLEAR, edata->sqlerrcode);
 		slr_defered_save_resowner = false;
+	}
 
 	/* Continue chain to previous hook */
 	if (prev_log_hook)
@@ -0,0 +1,39 @@
+# Test automatic retry of a write statement failing on a lock timeout: the
+# statement is executed again until the conflicting transaction commits.
+
+setup
+{
+	CREATE EXTENSION pg_statement_rollback;
+	CREATE TABLE tbl_retry(id integer PRIMARY KEY, val integer);
+	INSERT INTO tbl_retry VALUES (1, 0);
+}
+
+teardown
+{
+	DROP TABLE tbl_retry;
+	DROP EXTENSION pg_statement_rollback;
+}
+
+session s1
+setup
+{
+	LOAD 'pg_statement_rollback.so';
+	SET pg_statement_rollback.enabled TO on;
+	SET pg_statement_rollback.auto_retry TO 100;
+	SET pg_statement_rollback.auto_retry_delay TO '10ms';
+	SET lock_timeout TO '100ms';
+}
+step s1b	{ BEGIN; }
+step s1u	{ UPDATE tbl_retry SET val = val + 1 WHERE id = 1; }
+step s1c	{ COMMIT; }
+step s1r	{ SELECT recovered, exhausted, retries > 0 AS retried FROM pg_statement_rollback_retries(); }
+step s1s	{ SELECT * FROM tbl_retry; }
+
+session s2
+step s2b	{ BEGIN; }
+step s2u	{ UPDATE tbl_retry SET val = val + 10 WHERE id = 1; }
+step s2c	{ COMMIT; }
+
+# s1u fails on the lock timeout while s2 holds the row lock, and succeeds
+# once s2 has committed.
+permutation s2b s2u s1b s1u s2c s1c s1r s1s
@@ -0,0 +1,30 @@
+-- Test that an unused automatic savepoint is kept instead of being renewed
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+SET pg_statement_rollback.reuse_savepoint TO on;
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+SET log_min_duration_statement TO -1;
+SET log_statement TO 'all';
+SET log_duration TO off;
+SET client_min_messages TO LOG;
+
+\echo Test no-op statements do not renew the automatic savepoint
+BEGIN;
+DROP TABLE IF EXISTS tbl_rsl; -- nothing to drop, savepoint is kept
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+INSERT INTO tbl_rsl VALUES (1, 'one');
+UPDATE tbl_rsl SET val = 'none' WHERE id = 42; -- no row, savepoint is kept
+DELETE FROM tbl_rsl WHERE id = 42; -- no row, savepoint is kept
+INSERT INTO tbl_rsl VALUES ('two', 2); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+SELECT * FROM tbl_rsl; -- Should show record id 1
+COMMIT;
+
+DROP SCHEMA testrsl CASCADE;
@@ -0,0 +1,31 @@
+-- Test automatic savepoint renewed only every N statements
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+SET pg_statement_rollback.rollover_every TO 3;
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+
+SET log_min_duration_statement TO -1;
+SET log_statement TO 'all';
+SET log_duration TO off;
+SET client_min_messages TO LOG;
+
+\echo Test automatic savepoint every 3 write statements
+BEGIN;
+INSERT INTO tbl_rsl VALUES (1, 'one');
+INSERT INTO tbl_rsl VALUES (2, 'two');
+INSERT INTO tbl_rsl VALUES (3, 'three'); -- automatic savepoint
+INSERT INTO tbl_rsl VALUES (4, 'four');
+INSERT INTO tbl_rsl VALUES ('five', 5); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+SELECT * FROM tbl_rsl; -- Should show records id 1 to 3
+COMMIT;
+
+DROP SCHEMA testrsl CASCADE;
@@ -0,0 +1,51 @@
+-- Test writes to temporary tables or excluded schemas do not renew the savepoint
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+SET pg_statement_rollback.skip_temp_tables TO on;
+SET pg_statement_rollback.skip_schemas TO 'staging';
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+DROP SCHEMA IF EXISTS staging CASCADE;
+CREATE SCHEMA staging;
+DROP SCHEMA IF EXISTS "my.schema" CASCADE;
+CREATE SCHEMA "my.schema";
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+CREATE TABLE staging.tbl_stg(id integer);
+CREATE TEMPORARY TABLE tbl_tmp(id integer);
+CREATE TABLE "my.schema"."Tbl"(id integer);
+
+SET log_min_duration_statement TO -1;
+SET log_statement TO 'all';
+SET log_duration TO off;
+SET client_min_messages TO LOG;
+
+\echo Test writes to excluded relations
+BEGIN;
+INSERT INTO tbl_rsl VALUES (1, 'one');
+INSERT INTO tbl_tmp VALUES (1); -- no automatic savepoint
+INSERT INTO staging.tbl_stg VALUES (1); -- no automatic savepoint
+INSERT INTO tbl_rsl VALUES ('two', 2); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+SELECT * FROM tbl_rsl; -- Should show record id 1
+SELECT * FROM tbl_tmp; -- Should show 0 record
+COMMIT;
+
+\echo Test quoted names in skip_relations
+SET pg_statement_rollback.skip_relations TO 'testrsl.none, "my.schema"."Tbl"';
+BEGIN;
+INSERT INTO "my.schema"."Tbl" VALUES (1); -- no automatic savepoint
+COMMIT;
+SET pg_statement_rollback.skip_relations TO 'tbl_rsl'; -- not schema qualified, will fail
+SET pg_statement_rollback.skip_relations TO '"my.schema.Tbl'; -- will fail
+
+RESET client_min_messages;
+RESET log_statement;
+DROP SCHEMA "my.schema" CASCADE;
+DROP SCHEMA staging CASCADE;
+DROP SCHEMA testrsl CASCADE;
@@ -0,0 +1,43 @@
+-- Test per statement and per transaction opt-out of the automatic savepoint
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+
+SET log_min_duration_statement TO -1;
+SET log_statement TO 'all';
+SET log_duration TO off;
+SET client_min_messages TO LOG;
+
+\echo Test hint comment disabling the automatic savepoint
+BEGIN;
+INSERT INTO tbl_rsl VALUES (1, 'one');
+/*+ no_autosavepoint */ INSERT INTO tbl_rsl VALUES (2, 'two');
+INSERT INTO tbl_rsl VALUES ('three', 3); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+SELECT * FROM tbl_rsl; -- Should show record id 1
+COMMIT;
+
+\echo Test SET LOCAL disabling the automatic savepoint
+BEGIN;
+INSERT INTO tbl_rsl VALUES (2, 'two');
+SET LOCAL pg_statement_rollback.no_autosavepoint TO on;
+INSERT INTO tbl_rsl VALUES (3, 'three');
+INSERT INTO tbl_rsl VALUES ('four', 4); -- will fail
+ROLLBACK TO SAVEPOINT aze; -- the SET LOCAL is kept
+SELECT * FROM tbl_rsl; -- Should show records id 1 and 2
+SHOW pg_statement_rollback.no_autosavepoint;
+INSERT INTO tbl_rsl VALUES (5, 'five'); -- still no automatic savepoint
+INSERT INTO tbl_rsl VALUES ('six', 6); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+SELECT id FROM tbl_rsl ORDER BY id; -- Should show records id 1 and 2
+COMMIT;
+
+DROP SCHEMA testrsl CASCADE;
@@ -0,0 +1,38 @@
+-- Test rollback at statement level with prepared statements and cached plans
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+PREPARE ins(integer, varchar) AS INSERT INTO tbl_rsl VALUES ($1, $2);
+PREPARE sel AS SELECT * FROM tbl_rsl ORDER BY id;
+
+SET log_min_duration_statement TO -1;
+SET log_statement TO 'all';
+SET log_duration TO off;
+SET client_min_messages TO LOG;
+
+\echo Test cached plans after an error in the planner
+BEGIN;
+EXECUTE ins(1, 'one');
+SELECT 1/0; -- will fail in the planner
+ROLLBACK TO SAVEPOINT aze;
+EXECUTE ins(2, 'two');
+EXECUTE ins(3, 'three');
+EXECUTE ins(4, 'four');
+EXECUTE ins(5, 'five');
+EXECUTE ins(6, 'six'); -- generic plan, the planner is not called
+EXECUTE ins(7, repeat('x', 300)); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+EXECUTE sel; -- No automatic savepoint on SELECT, should show records id 1 to 6
+COMMIT;
+
+DEALLOCATE ins;
+DEALLOCATE sel;
+DROP SCHEMA testrsl CASCADE;
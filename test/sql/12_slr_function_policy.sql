@@ -0,0 +1,34 @@
+-- Test functions writing to tables without going through the executor
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+SET pg_statement_rollback.write_functions TO 'pg_catalog.lo_create';
+
+SET log_min_duration_statement TO -1;
+SET log_statement TO 'all';
+SET log_duration TO off;
+SET client_min_messages TO LOG;
+
+\echo Test SELECT calling a function listed in write_functions
+BEGIN;
+SELECT lo_create(424242);
+SELECT 1/0; -- will fail
+ROLLBACK TO SAVEPOINT aze;
+SELECT count(*) FROM pg_largeobject_metadata WHERE oid = 424242; -- Should return 1
+SELECT lo_unlink(424242); -- No automatic savepoint, not listed
+ROLLBACK;
+
+\echo Test SELECT calling a volatile built-in function with volatile_c_functions_write
+SET pg_statement_rollback.write_functions TO '';
+SET pg_statement_rollback.volatile_c_functions_write TO on;
+BEGIN;
+SELECT lo_create(424243);
+SELECT 1/0; -- will fail
+ROLLBACK TO SAVEPOINT aze;
+SET pg_statement_rollback.readonly_functions TO 'pg_catalog.lo_create';
+SELECT lo_create(424244); -- No automatic savepoint, listed as read only
+SELECT 1/0; -- will fail
+ROLLBACK TO SAVEPOINT aze;
+SELECT oid FROM pg_largeobject_metadata WHERE oid IN (424243, 424244); -- Should return 424243
+ROLLBACK;
@@ -0,0 +1,34 @@
+-- Test automatic retry of statements, without lock conflict
+CREATE EXTENSION pg_statement_rollback;
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+SET pg_statement_rollback.auto_retry TO 3;
+SET pg_statement_rollback.auto_retry_delay TO '5ms';
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+
+SET log_min_duration_statement TO -1;
+SET log_statement TO 'all';
+SET log_duration TO off;
+SET client_min_messages TO LOG;
+
+\echo Test write statements executed with the automatic retry enabled
+BEGIN;
+INSERT INTO tbl_rsl VALUES (1, 'one'), (2, 'two');
+UPDATE tbl_rsl SET val = 'deux' WHERE id = 2;
+INSERT INTO tbl_rsl VALUES ('three', 3); -- will fail, not retried
+ROLLBACK TO SAVEPOINT aze;
+DELETE FROM tbl_rsl WHERE id = 1 RETURNING *; -- not retryable
+SELECT * FROM tbl_rsl; -- Should show record id 2
+SELECT * FROM pg_statement_rollback_retries();
+COMMIT;
+
+DROP SCHEMA testrsl CASCADE;
+DROP EXTENSION pg_statement_rollback;
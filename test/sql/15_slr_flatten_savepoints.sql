@@ -0,0 +1,37 @@
+-- Test a single automatic savepoint above the client savepoints
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+SET pg_statement_rollback.flatten_savepoints TO on;
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+
+SET log_min_duration_statement TO -1;
+SET log_statement TO 'all';
+SET log_duration TO off;
+SET client_min_messages TO LOG;
+
+\echo Test client savepoints with flattened automatic savepoints
+BEGIN;
+INSERT INTO tbl_rsl VALUES (1, 'one');
+SAVEPOINT s1;
+INSERT INTO tbl_rsl VALUES (2, 'two');
+SAVEPOINT s2;
+INSERT INTO tbl_rsl VALUES (3, 'three');
+INSERT INTO tbl_rsl VALUES ('four', 4); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+RELEASE SAVEPOINT s2;
+INSERT INTO tbl_rsl VALUES ('five', 5); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+ROLLBACK TO SAVEPOINT s1;
+INSERT INTO tbl_rsl VALUES (4, 'four');
+SELECT * FROM tbl_rsl; -- Should show records id 1, 2 and 4
+COMMIT;
+
+DROP SCHEMA testrsl CASCADE;
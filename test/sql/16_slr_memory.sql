@@ -0,0 +1,36 @@
+-- Test the memory retained by the automatic savepoints and its bound
+CREATE EXTENSION pg_statement_rollback;
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+SET log_min_duration_statement TO -1;
+SET log_statement TO 'all';
+SET log_duration TO off;
+SET client_min_messages TO LOG;
+
+\echo Test the accounting of the memory retained by released savepoints
+BEGIN;
+CREATE TABLE tbl_rsl1(id integer);
+CREATE TABLE tbl_rsl2(id integer);
+SELECT released_savepoints, retained_contexts > 0 AS retained FROM pg_statement_rollback_memory();
+ROLLBACK;
+
+\echo Test that the automatic savepoint is no longer renewed past the bound
+SET pg_statement_rollback.max_retained_memory TO '1kB';
+BEGIN;
+CREATE TABLE tbl_rsl3(id integer);
+CREATE TABLE tbl_rsl4(id integer); -- savepoint not renewed
+INSERT INTO tbl_rsl4 VALUES ('x'); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+SELECT count(*) FROM pg_class WHERE relname IN ('tbl_rsl3', 'tbl_rsl4'); -- Should be 1
+COMMIT;
+
+DROP SCHEMA testrsl CASCADE;
+DROP EXTENSION pg_statement_rollback;
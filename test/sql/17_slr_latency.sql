@@ -0,0 +1,24 @@
+-- Test the latency histogram of the rollovers
+CREATE EXTENSION pg_statement_rollback;
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+
+\echo Test that each rollover is counted once
+BEGIN;
+INSERT INTO tbl_rsl VALUES (1, 'one');
+INSERT INTO tbl_rsl VALUES (2, 'two');
+SELECT count(*) FROM tbl_rsl; -- no rollover
+COMMIT;
+SELECT sum(count) AS rollovers, count(*) AS buckets FROM pg_statement_rollback_latency();
+
+DROP SCHEMA testrsl CASCADE;
+DROP EXTENSION pg_statement_rollback;
@@ -0,0 +1,43 @@
+-- Test the sampling of the automatic savepoint orders in the log
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+
+SET log_min_duration_statement TO -1;
+SET log_statement TO 'all';
+SET log_duration TO off;
+SET client_min_messages TO LOG;
+
+\echo Test that no order is logged with a sample rate of 0
+SET pg_statement_rollback.log_sample_rate TO 0;
+BEGIN;
+INSERT INTO tbl_rsl VALUES (1, 'one');
+INSERT INTO tbl_rsl VALUES ('two', 2); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+SELECT * FROM tbl_rsl; -- Should show record id 1
+COMMIT;
+
+\echo Test that all orders are logged with a sample rate of 1
+SET pg_statement_rollback.log_sample_rate TO 1;
+BEGIN;
+INSERT INTO tbl_rsl VALUES (2, 'two');
+COMMIT;
+
+\echo Test that the summary replaces the orders
+SET pg_statement_rollback.log_summary TO on;
+BEGIN;
+INSERT INTO tbl_rsl VALUES (3, 'three');
+INSERT INTO tbl_rsl VALUES ('four', 4); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+COMMIT; -- 2 created, 1 released, 1 rolled back to
+SET pg_statement_rollback.log_summary TO off;
+
+DROP SCHEMA testrsl CASCADE;
@@ -0,0 +1,48 @@
+-- Test the trace buffer of the decisions
+CREATE EXTENSION pg_statement_rollback;
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+SET pg_statement_rollback.trace TO on;
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+
+\echo Test that the savepoint decisions are recorded
+SELECT coalesce(max(seq), 0) AS start FROM pg_statement_rollback_trace() \gset
+BEGIN;
+INSERT INTO tbl_rsl VALUES (1, 'one');
+INSERT INTO tbl_rsl VALUES (1/0, 'two'); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+INSERT INTO tbl_rsl VALUES (3, 'three');
+COMMIT;
+SELECT event, nest_level, detail FROM pg_statement_rollback_trace()
+WHERE seq > :start
+  AND event IN ('add_savepoint', 'release_savepoint', 'rollback_to')
+ORDER BY seq;
+
+\echo Test the SQLSTATE of an error clearing a deferred savepoint
+CREATE FUNCTION f_ins(i integer) RETURNS integer LANGUAGE sql
+    AS 'INSERT INTO tbl_rsl VALUES (i, ''f_ins'') RETURNING id';
+SELECT coalesce(max(seq), 0) AS start FROM pg_statement_rollback_trace() \gset
+SELECT f_ins(i), 1 / (i - 2) FROM generate_series(1, 3) i; -- will fail
+SELECT event, detail <> 0 AS packed, sqlstate FROM pg_statement_rollback_trace()
+WHERE seq > :start AND event = 'deferred_clear';
+
+\echo Test that nothing is recorded when disabled
+SELECT coalesce(max(seq), 0) AS start FROM pg_statement_rollback_trace() \gset
+SET pg_statement_rollback.trace TO off;
+BEGIN;
+INSERT INTO tbl_rsl VALUES (4, 'four');
+COMMIT;
+SET pg_statement_rollback.trace TO on;
+SELECT count(*) FROM pg_statement_rollback_trace()
+WHERE seq > :start AND event = 'add_savepoint'; -- Should be 0
+
+DROP SCHEMA testrsl CASCADE;
+DROP EXTENSION pg_statement_rollback;
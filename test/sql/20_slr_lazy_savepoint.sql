@@ -0,0 +1,48 @@
+-- Test lazy savepoint renewal with multi-statement query strings
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+SET pg_statement_rollback.lazy_savepoint TO on;
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+
+SET log_min_duration_statement TO -1;
+SET log_statement TO 'all';
+SET log_duration TO off;
+SET client_min_messages TO LOG;
+
+\echo Test no renewal before COMMIT, END and ABORT
+BEGIN;
+INSERT INTO tbl_rsl VALUES (1, 'one') \; COMMIT;
+BEGIN;
+INSERT INTO tbl_rsl VALUES (2, 'two') \; end;
+BEGIN;
+INSERT INTO tbl_rsl VALUES (3, 'three') \; ABORT;
+
+\echo Test renewal before ROLLBACK TO but not before ROLLBACK
+BEGIN;
+INSERT INTO tbl_rsl VALUES (4, 'four') \; ROLLBACK TO SAVEPOINT aze;
+INSERT INTO tbl_rsl VALUES (5, 'five') \; rollback transaction to aze;
+SELECT id FROM tbl_rsl ORDER BY id; -- Should show records id 1, 2, 4 and 5
+INSERT INTO tbl_rsl VALUES (6, 'six') \; ROLLBACK WORK;
+
+\echo Test comments and blanks before the next statement
+BEGIN;
+INSERT INTO tbl_rsl VALUES (7, 'seven') \;   /* a /* nested */ comment */  COMMIT;
+BEGIN;
+INSERT INTO tbl_rsl VALUES (8, 'eight') \; -- a comment
+COMMIT;
+BEGIN;
+INSERT INTO tbl_rsl VALUES (9, 'nine') \; /* COMMIT */ INSERT INTO tbl_rsl VALUES (10, 'ten');
+INSERT INTO tbl_rsl VALUES ('eleven', 11); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+COMMIT;
+SELECT id FROM tbl_rsl ORDER BY id; -- Should show records id 1, 2, 4, 5 and 7 to 10
+
+DROP SCHEMA testrsl CASCADE;
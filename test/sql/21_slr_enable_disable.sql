@@ -0,0 +1,56 @@
+-- Test enabling and disabling the extension in a session
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+
+SET log_min_duration_statement TO -1;
+SET log_statement TO 'all';
+SET log_duration TO off;
+SET client_min_messages TO LOG;
+
+\echo Test disabling the extension in the session
+SET pg_statement_rollback.enabled TO off;
+BEGIN;
+INSERT INTO tbl_rsl VALUES (0, 'zero');
+INSERT INTO tbl_rsl VALUES ('zero', 0); -- will fail
+ROLLBACK TO SAVEPOINT aze; -- will fail, there is no automatic savepoint
+ROLLBACK;
+
+\echo Test enabling it again in the session
+SET pg_statement_rollback.enabled TO on;
+BEGIN;
+INSERT INTO tbl_rsl VALUES (1, 'one');
+
+\echo Test disabling the extension in a transaction
+SET pg_statement_rollback.enabled TO off; -- no automatic savepoint anymore
+INSERT INTO tbl_rsl VALUES (2, 'two');
+INSERT INTO tbl_rsl VALUES ('three', 3); -- will fail
+ROLLBACK TO SAVEPOINT aze; -- the SET is rolled back too
+SHOW pg_statement_rollback.enabled;
+INSERT INTO tbl_rsl VALUES (3, 'three'); -- no automatic savepoint before the next transaction
+COMMIT;
+SELECT id FROM tbl_rsl ORDER BY id; -- Should show records id 1 and 3
+
+\echo Test enabling the extension in a transaction
+SET pg_statement_rollback.enabled TO off;
+BEGIN;
+INSERT INTO tbl_rsl VALUES (4, 'four');
+SET pg_statement_rollback.enabled TO on; -- no automatic savepoint before the next transaction
+INSERT INTO tbl_rsl VALUES (5, 'five');
+COMMIT;
+BEGIN;
+INSERT INTO tbl_rsl VALUES (6, 'six');
+INSERT INTO tbl_rsl VALUES ('seven', 7); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+COMMIT;
+SELECT id FROM tbl_rsl ORDER BY id; -- Should show records id 1 and 3 to 6
+
+DROP SCHEMA testrsl CASCADE;
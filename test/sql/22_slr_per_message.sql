@@ -0,0 +1,41 @@
+-- Test the client message as recovery unit with multi-statement strings
+CREATE EXTENSION pg_statement_rollback;
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+SET pg_statement_rollback.trace TO on;
+SET pg_statement_rollback.rollover_per_message TO on;
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+
+SELECT coalesce(max(seq), 0) AS start FROM pg_statement_rollback_trace() \gset
+
+SET log_min_duration_statement TO -1;
+SET log_statement TO 'all';
+SET log_duration TO off;
+SET client_min_messages TO LOG;
+
+\echo Test a single rollover after the last statement of a message
+BEGIN;
+INSERT INTO tbl_rsl VALUES (1, 'one') \; INSERT INTO tbl_rsl VALUES (2, 'two') \; INSERT INTO tbl_rsl VALUES (3, 'three');
+
+\echo Test an error in the middle of a message
+INSERT INTO tbl_rsl VALUES (4, 'four') \; INSERT INTO tbl_rsl VALUES (1/0, 'five') \; INSERT INTO tbl_rsl VALUES (6, 'six');
+ROLLBACK TO SAVEPOINT aze; -- the whole message is rolled back
+INSERT INTO tbl_rsl VALUES (7, 'seven');
+SELECT id FROM tbl_rsl ORDER BY id; -- Should show records id 1 to 3 and 7
+COMMIT;
+
+SET client_min_messages TO WARNING;
+SET log_statement TO 'none';
+SELECT count(*) FROM pg_statement_rollback_trace()
+WHERE seq > :start AND event = 'add_savepoint'; -- Should be 3
+
+DROP SCHEMA testrsl CASCADE;
+DROP EXTENSION pg_statement_rollback;
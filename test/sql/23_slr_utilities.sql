@@ -0,0 +1,51 @@
+-- Test utility statements that do not renew the automatic savepoint
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+
+SET log_min_duration_statement TO -1;
+SET log_statement TO 'all';
+SET log_duration TO off;
+SET client_min_messages TO LOG;
+
+\echo Test harmless utilities and EXPLAIN ANALYZE
+BEGIN;
+INSERT INTO tbl_rsl VALUES (1, 'one');
+SHOW search_path; -- no automatic savepoint
+\o /dev/null
+EXPLAIN (COSTS OFF) INSERT INTO tbl_rsl VALUES (2, 'two'); -- no automatic savepoint
+\o
+DECLARE c CURSOR FOR SELECT id FROM tbl_rsl;
+CLOSE c; -- no automatic savepoint
+\o /dev/null
+EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF) INSERT INTO tbl_rsl VALUES (3, 'three');
+\o
+
+\echo Test utilities listed in skip_utilities
+ANALYZE tbl_rsl;
+SET pg_statement_rollback.skip_utilities TO ' analyze , NOTIFY';
+ANALYZE tbl_rsl; -- no automatic savepoint
+INSERT INTO tbl_rsl VALUES ('four', 4); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+SELECT id FROM tbl_rsl ORDER BY id; -- Should show records id 1 and 3
+COMMIT;
+
+\echo Test reassigning and resetting skip_utilities
+SET pg_statement_rollback.skip_utilities TO 'VACUUM';
+SET pg_statement_rollback.skip_utilities TO 'CHECKPOINT, ANALYZE';
+SHOW pg_statement_rollback.skip_utilities;
+RESET pg_statement_rollback.skip_utilities;
+SHOW pg_statement_rollback.skip_utilities;
+BEGIN;
+ANALYZE tbl_rsl; -- renews the automatic savepoint again
+COMMIT;
+
+DROP SCHEMA testrsl CASCADE;
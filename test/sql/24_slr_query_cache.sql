@@ -0,0 +1,37 @@
+-- Test the classification cache of statements by query identifier
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+SET compute_query_id TO on;
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+
+\echo Fill the cache with more statements than it can hold
+DO $$ BEGIN FOR i IN 1..1100 LOOP EXECUTE 'SELECT ' || repeat('1, ', i) || '1'; END LOOP; END $$;
+
+SET log_min_duration_statement TO -1;
+SET log_statement TO 'all';
+SET log_duration TO off;
+SET client_min_messages TO LOG;
+
+\echo Test a change of the relation policy on a cached statement
+BEGIN;
+INSERT INTO tbl_rsl VALUES (1, 'one');
+SET pg_statement_rollback.skip_relations TO 'testrsl.tbl_rsl';
+INSERT INTO tbl_rsl VALUES (2, 'two'); -- same query identifier, no automatic savepoint
+RESET pg_statement_rollback.skip_relations;
+INSERT INTO tbl_rsl VALUES (3, 'three');
+SET pg_statement_rollback.skip_schemas TO 'testrsl';
+INSERT INTO tbl_rsl VALUES (4, 'four'); -- no automatic savepoint
+INSERT INTO tbl_rsl VALUES ('five', 5); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+SELECT id FROM tbl_rsl ORDER BY id; -- Should show records id 1 to 3
+COMMIT;
+
+DROP SCHEMA testrsl CASCADE;
@@ -0,0 +1,56 @@
+-- Test automatic savepoints with generic plans and the extended protocol,
+-- \bind requires psql 16 or later
+CREATE EXTENSION pg_statement_rollback;
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.enable_writeonly TO on;
+SET pg_statement_rollback.trace TO on;
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+
+\echo Test the savepoints created with generic plans
+SET plan_cache_mode TO force_generic_plan;
+PREPARE ins(integer, varchar) AS INSERT INTO tbl_rsl VALUES ($1, $2);
+PREPARE sel AS SELECT id FROM tbl_rsl ORDER BY id;
+SELECT coalesce(max(seq), 0) AS start FROM pg_statement_rollback_trace() \gset
+BEGIN;
+EXECUTE ins(1, 'one');
+EXECUTE sel;
+EXECUTE ins(2, 'two');
+EXECUTE sel;
+EXECUTE ins(3, 'three');
+EXECUTE ins(4, repeat('x', 300)); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+COMMIT;
+SELECT event, count(*) FROM pg_statement_rollback_trace()
+WHERE seq > :start
+  AND event IN ('add_savepoint', 'release_savepoint')
+GROUP BY event ORDER BY event; -- Should be 4 and 3
+DEALLOCATE ins;
+DEALLOCATE sel;
+RESET plan_cache_mode;
+
+\echo Test the savepoints created with the extended protocol
+SELECT coalesce(max(seq), 0) AS start FROM pg_statement_rollback_trace() \gset
+BEGIN;
+INSERT INTO tbl_rsl VALUES ($1, $2) \bind 5 'five' \g
+SELECT id FROM tbl_rsl WHERE id > $1 ORDER BY id \bind 3 \g
+INSERT INTO tbl_rsl VALUES ($1, $2) \bind 6 'six' \g
+INSERT INTO tbl_rsl VALUES ($1, repeat('x', $2)) \bind 7 300 \g
+ROLLBACK TO SAVEPOINT aze;
+INSERT INTO tbl_rsl VALUES ($1, $2) \bind 8 'eight' \g
+COMMIT;
+SELECT event, count(*) FROM pg_statement_rollback_trace()
+WHERE seq > :start
+  AND event IN ('add_savepoint', 'release_savepoint')
+GROUP BY event ORDER BY event; -- Should be 4 and 3
+SELECT id FROM tbl_rsl ORDER BY id; -- Should show records id 1 to 3, 5, 6 and 8
+
+DROP SCHEMA testrsl CASCADE;
+DROP EXTENSION pg_statement_rollback;
@@ -0,0 +1,54 @@
+-- Test the locks taken by the planner with hoist_planner_locks,
+-- \bind requires psql 16 or later
+LOAD 'pg_statement_rollback.so';
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET pg_statement_rollback.hoist_planner_locks TO on;
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_hoist(id integer, val varchar(256)) PARTITION BY LIST (id);
+CREATE TABLE tbl_hoist_1 PARTITION OF tbl_hoist FOR VALUES IN (1);
+CREATE TABLE tbl_hoist_2 PARTITION OF tbl_hoist FOR VALUES IN (2);
+INSERT INTO tbl_hoist VALUES (1, 'one'), (2, 'two');
+
+CREATE VIEW slr_locks AS
+    SELECT c.relname, l.mode
+    FROM pg_locks l JOIN pg_class c ON c.oid = l.relation
+    WHERE l.pid = pg_backend_pid() AND c.relname LIKE 'tbl_hoist%'
+    ORDER BY 1, 2;
+
+\echo Test the locks of the partitions kept after ROLLBACK TO SAVEPOINT
+BEGIN;
+UPDATE tbl_hoist SET id = id / 0; -- will fail
+ROLLBACK TO SAVEPOINT aze;
+SELECT * FROM slr_locks; -- Should show the partitions only
+COMMIT;
+SELECT * FROM slr_locks; -- Should show nothing
+
+\echo Test the locks of a prepared statement planned again by EXECUTE
+PREPARE upd(integer) AS UPDATE tbl_hoist SET val = upper(val) WHERE id / $1 = 1;
+BEGIN;
+EXECUTE upd(0); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+SELECT * FROM slr_locks; -- Should show nothing, planned inside the utility
+EXECUTE upd(1);
+SELECT * FROM slr_locks; -- Should show the table and the partitions
+COMMIT;
+
+\echo Test the locks of statements planned at Bind with the extended protocol
+BEGIN;
+UPDATE tbl_hoist SET val = upper(val) WHERE id / $1 = 2 \bind 0 \g
+ROLLBACK TO SAVEPOINT aze;
+SELECT * FROM slr_locks; -- Should show the partitions only
+UPDATE tbl_hoist SET val = upper(val) WHERE id / $1 = 2 \bind 1 \g
+COMMIT;
+SELECT * FROM tbl_hoist ORDER BY id;
+
+DEALLOCATE upd;
+DROP VIEW slr_locks;
+DROP TABLE tbl_hoist;
+DROP SCHEMA testrsl;
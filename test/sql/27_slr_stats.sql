@@ -0,0 +1,38 @@
+-- Test the statistics in shared memory, run with test/preload.conf
+CREATE EXTENSION pg_statement_rollback;
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+
+CREATE VIEW slr_stats AS
+    SELECT savepoints, released, rolled_back, rollovers, rollovers_elided
+    FROM pg_statement_rollback_stats
+    WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database())
+      AND userid = (SELECT oid FROM pg_roles WHERE rolname = current_user);
+
+\echo Test the counters of a transaction
+SELECT count(*) FROM pg_statement_rollback_stats_reset();
+BEGIN;
+INSERT INTO tbl_rsl VALUES (1, 'one');
+INSERT INTO tbl_rsl VALUES ('two', 2); -- will fail
+ROLLBACK TO SAVEPOINT aze;
+/*+ no_autosavepoint */ INSERT INTO tbl_rsl VALUES (3, 'three');
+INSERT INTO tbl_rsl VALUES (4, 'four');
+COMMIT;
+SELECT * FROM slr_stats; -- Should be 3, 2, 1, 2 and 1
+
+\echo Test the reset of the counters
+SELECT count(*) FROM pg_statement_rollback_stats_reset();
+SELECT * FROM slr_stats; -- Should be 0
+SELECT count(*) FROM pg_statement_rollback_query_stats; -- Should be 0
+
+DROP VIEW slr_stats;
+DROP TABLE tbl_rsl;
+DROP SCHEMA testrsl;
+DROP EXTENSION pg_statement_rollback;
@@ -0,0 +1,44 @@
+-- Test the statistics per statement, run with test/preload.conf
+CREATE EXTENSION pg_statement_rollback;
+SET pg_statement_rollback.enabled TO on;
+SET pg_statement_rollback.savepoint_name TO 'aze';
+SET compute_query_id TO on;
+
+DROP SCHEMA IF EXISTS testrsl CASCADE;
+CREATE SCHEMA testrsl;
+
+SET search_path TO testrsl,public;
+
+CREATE TABLE tbl_rsl(id integer, val varchar(256));
+
+CREATE VIEW slr_query_stats AS
+    SELECT rollovers, rolled_back
+    FROM pg_statement_rollback_query_stats
+    WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database())
+      AND userid = (SELECT oid FROM pg_roles WHERE rolname = current_user)
+    ORDER BY rollovers, rolled_back;
+
+\echo Test the counters of the statements of a transaction
+SELECT count(*) FROM pg_statement_rollback_stats_reset();
+BEGIN;
+INSERT INTO tbl_rsl VALUES (1, 'one');
+INSERT INTO tbl_rsl VALUES (2, 'two'); -- same queryid
+UPDATE tbl_rsl SET val = 'deux' WHERE id = 2;
+UPDATE tbl_rsl SET id = id / 0 WHERE id = 2; -- will fail
+ROLLBACK TO SAVEPOINT aze;
+COMMIT;
+SELECT * FROM slr_query_stats; -- Should show 0 and 1, 1 and 0, 2 and 0
+
+\echo Test the counters added by a second transaction
+BEGIN;
+INSERT INTO tbl_rsl VALUES (3, 'three');
+COMMIT;
+SELECT * FROM slr_query_stats; -- Should show 0 and 1, 1 and 0, 3 and 0
+
+SELECT count(*) FROM pg_statement_rollback_stats_reset();
+SELECT * FROM slr_query_stats; -- Should show nothing
+
+DROP VIEW slr_query_stats;
+DROP TABLE tbl_rsl;
+DROP SCHEMA testrsl;
+DROP EXTENSION pg_statement_rollback;